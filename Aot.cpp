@@ -0,0 +1,130 @@
+#include "Aot.h"
+
+#include <algorithm>
+#include <chrono>
+#include <cstdlib>
+#include <cstring>
+#include <iostream>
+#include <string>
+
+Aot::Aot(Chip8& m, const AotProgram& p) : machine(m), program(p)
+{
+    blockAt.fill(-1);
+    for (size_t b = 0; b < program.blockCount; b++)
+    {
+        const AotBlock& block = program.blocks[b];
+        for (uint16_t a = block.start; a < block.end; a += 2)
+        {
+            blockAt[a] = b;
+        }
+        for (uint16_t a = block.start; a < block.end; a++)
+        {
+            owners[a].push_back(b);
+        }
+    }
+    // Nothing runs until it has been checked against memory
+    state.assign(program.blockCount, Unchecked);
+
+    original.fill(0);
+    std::copy(Chip8::font, Chip8::font + 80, original.begin());
+    std::copy(Chip8::bigFont, Chip8::bigFont + 160, original.begin() + Chip8::BigFontStart);
+    std::memcpy(&original[Chip8::ProgramStart], program.rom,
+        std::min<size_t>(program.size, Chip8::ClassicMemorySize - Chip8::ProgramStart));
+}
+
+uint64_t Aot::run(uint64_t n)
+{
+    if (machine.quirkProfile != program.quirks)
+    {
+        return machine.interpret(n);
+    }
+    const uint64_t start = machine.cycles;
+    const uint64_t end = start + n;
+    while (machine.cycles < end && !machine.done)
+    {
+        const uint16_t pc = machine.addrptr;
+        const int32_t b = pc < Chip8::ClassicMemorySize ? blockAt[pc] : -1;
+        if (b >= 0 && (state[b] == Valid || (state[b] == Unchecked && check(b))))
+        {
+            // Stop where the budget runs out, even in the middle
+            const AotBlock& block = program.blocks[b];
+            const uint32_t from = (pc - block.start) / 2;
+            const uint32_t to = std::min<uint64_t>(block.length, from + (end - machine.cycles));
+            block.run(machine, from, to);
+            continue;
+        }
+        machine.interpret(1);
+        if (machine.addrptr == pc && machine.decoded[pc].handler == Chip8::OpWaitKey)
+        {
+            // Waiting for a key, which can not arrive before the next run
+            machine.cycles = end;
+        }
+    }
+    return machine.cycles - start;
+}
+
+void Aot::invalidate(uint16_t addr, uint16_t len)
+{
+    for (uint32_t i = 0; i < len; i++)
+    {
+        for (int32_t b : owners[(addr + i) & (Chip8::ClassicMemorySize - 1)])
+        {
+            state[b] = Unchecked;
+        }
+    }
+}
+
+bool Aot::check(int32_t b)
+{
+    const AotBlock& block = program.blocks[b];
+    const bool same = std::memcmp(&machine.memory[block.start], &original[block.start], block.end - block.start) == 0;
+    state[b] = same ? Valid : Changed;
+    return same;
+}
+
+int aotMain(int argc, char* argv[], const AotProgram& program)
+{
+    uint64_t cycles = 1000000;
+    long ips = 700;
+    for (int a = 1; a < argc; a++)
+    {
+        std::string arg = argv[a];
+        if (arg == "--ips" && a+1 < argc)
+        {
+            ips = std::max(60L, std::strtol(argv[++a], nullptr, 0));
+        }
+        else if (arg[0] != '-')
+        {
+            cycles = std::strtoull(arg.c_str(), nullptr, 0);
+        }
+        else
+        {
+            std::cerr << "usage: " << argv[0] << " [--ips N] [cycles]" << std::endl;
+            return 2;
+        }
+    }
+    const uint64_t instructionsPerTick = ips / 60;
+
+    static Chip8 machine;
+    machine.setQuirks(program.quirks);
+    if (!machine.load(program.rom, program.size) || !machine.enableAot(program))
+    {
+        std::cerr << "Could not load the translated ROM" << std::endl;
+        return 1;
+    }
+
+    // Same frames as chip-headless, so the results can be compared
+    auto start = std::chrono::steady_clock::now();
+    while (!machine.done && machine.cycles < cycles)
+    {
+        machine.runFrame(std::min(cycles - machine.cycles, instructionsPerTick));
+    }
+    std::chrono::duration<double> elapsed = std::chrono::steady_clock::now() - start;
+
+    std::cout << "cycles: " << machine.cycles << std::endl;
+    std::cout << "seconds: " << elapsed.count() << std::endl;
+    std::cout << "ips: " << (uint64_t)(machine.cycles / elapsed.count()) << std::endl;
+    std::cout << "screen: " << std::hex << machine.screenHash() << std::dec << std::endl;
+    std::cout << "exit: " << Chip8::exitName((Chip8::ExitReason)machine.exitReason) << std::endl;
+    return 0;
+}
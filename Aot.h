@@ -0,0 +1,86 @@
+#pragma once
+
+#include <array>
+#include <cstdint>
+#include <cstddef>
+#include <vector>
+
+#include "Chip8.h"
+
+// Runtime for ROMs translated ahead of time by chip-aot. The tool follows
+// every path from 0x200 and writes a C++ file with one function per basic
+// block, the ROM bytes and a table of the blocks; linked against libchip8 it
+// becomes a native binary for that one ROM.
+//
+// A block only runs while the bytes it was translated from are still in
+// memory. Writes that hit code (Fx55 rewriting the program, a different ROM)
+// mark the blocks there unchecked; the next visit compares them with the ROM
+// once and either runs them again or leaves them to the interpreter until the
+// next write. Bnnn, Fx0A and anything the analysis did not reach are always
+// interpreted.
+
+// One basic block, `length` instructions at [start, end)
+struct AotBlock
+{
+    uint16_t start;
+    uint16_t end;
+    uint32_t length;
+    // Runs instructions `from` to `to` (exclusive) of the block, counts them
+    // in cycles and leaves addrptr at the next one
+    void (*run)(Chip8& m, uint32_t from, uint32_t to);
+};
+
+// What a translated file exports
+struct AotProgram
+{
+    // The ROM as loaded at 0x200
+    const uint8_t* rom;
+    uint32_t size;
+    // The blocks are only valid with these quirks
+    Chip8::QuirkProfile quirks;
+    const AotBlock* blocks;
+    size_t blockCount;
+};
+
+class Aot
+{
+public:
+    Aot(Chip8& m, const AotProgram& p);
+    Aot(const Aot&) = delete;
+    Aot& operator=(const Aot&) = delete;
+
+    // Same as Chip8::interpret(n), through the translated blocks where
+    // possible. Runs everything in the interpreter if the quirks changed.
+    uint64_t run(uint64_t n);
+    // Mark every block containing a byte in [addr, addr+len) unchecked
+    void invalidate(uint16_t addr, uint16_t len);
+
+private:
+    Chip8& machine;
+    const AotProgram& program;
+    // Block with an instruction at each address, or -1
+    std::array<int32_t, Chip8::ClassicMemorySize> blockAt;
+    // Blocks containing each address, usually none or one
+    std::array<std::vector<int32_t>, Chip8::ClassicMemorySize> owners;
+    // Per block
+    enum State : uint8_t
+    {
+        // Memory holds the translated bytes
+        Valid,
+        // Written to since the last check
+        Unchecked,
+        // Memory holds something else, interpreted until written again
+        Changed,
+    };
+    std::vector<State> state;
+    // Memory right after reset() and loading the ROM
+    std::array<uint8_t, Chip8::ClassicMemorySize> original;
+
+    // Compare an Unchecked block with memory, true if it is Valid
+    bool check(int32_t b);
+};
+
+// main() of a translated ROM, see chip-aot:
+//   <binary> [--ips N] [cycles]
+// prints the same summary as chip-headless.
+int aotMain(int argc, char* argv[], const AotProgram& program);
@@ -0,0 +1,285 @@
+#include "Audio.h"
+
+#include <algorithm>
+#include <cmath>
+
+#ifdef HAVE_ALSA
+#include <alsa/asoundlib.h>
+#endif
+
+namespace
+{
+    const int16_t amplitude = 8000;
+    // Samples a real-time sink may lag behind, about 90 ms at 44.1 kHz
+    const size_t ringSamples = 4096;
+    // Samples handed to a real-time sink at once
+    const size_t chunkSamples = 256;
+
+    void put16(uint8_t* p, uint16_t v)
+    {
+        p[0] = v & 0xff;
+        p[1] = v >> 8;
+    }
+
+    void put32(uint8_t* p, uint32_t v)
+    {
+        put16(p, v & 0xffff);
+        put16(p + 2, v >> 16);
+    }
+}
+
+WavSink::WavSink() : file(nullptr), rate(0), bytes(0), failed(false)
+{
+}
+
+WavSink::~WavSink()
+{
+    close();
+}
+
+bool WavSink::open(const std::string& filename, uint32_t sampleRate)
+{
+    close();
+    file = std::fopen(filename.c_str(), "wb");
+    if (!file)
+    {
+        return false;
+    }
+    rate = sampleRate;
+    bytes = 0;
+    failed = false;
+    // Sizes are patched in by close()
+    writeHeader();
+    return !failed;
+}
+
+void WavSink::writeHeader()
+{
+    const uint32_t data = (uint32_t)std::min<uint64_t>(bytes, UINT32_MAX - 36);
+    uint8_t header[44] = {'R', 'I', 'F', 'F', 0, 0, 0, 0, 'W', 'A', 'V', 'E', 'f', 'm', 't', ' '};
+    put32(header + 4, 36 + data);
+    put32(header + 16, 16);
+    // PCM, mono, 16 bit
+    put16(header + 20, 1);
+    put16(header + 22, 1);
+    put32(header + 24, rate);
+    put32(header + 28, rate * 2);
+    put16(header + 32, 2);
+    put16(header + 34, 16);
+    header[36] = 'd'; header[37] = 'a'; header[38] = 't'; header[39] = 'a';
+    put32(header + 40, data);
+    failed |= std::fwrite(header, 1, sizeof(header), file) != sizeof(header);
+}
+
+bool WavSink::close()
+{
+    if (!file)
+    {
+        return !failed;
+    }
+    failed |= std::fseek(file, 0, SEEK_SET) != 0;
+    writeHeader();
+    failed |= std::fclose(file) != 0;
+    file = nullptr;
+    return !failed;
+}
+
+bool WavSink::write(const int16_t* samples, size_t count)
+{
+    if (!file)
+    {
+        return false;
+    }
+    uint8_t data[chunkSamples * 2];
+    while (count)
+    {
+        // Little endian whatever the host is
+        size_t n = std::min(count, chunkSamples);
+        for (size_t i = 0; i < n; i++)
+        {
+            put16(data + 2 * i, (uint16_t)samples[i]);
+        }
+        failed |= std::fwrite(data, 2, n, file) != n;
+        bytes += 2 * n;
+        samples += n;
+        count -= n;
+    }
+    return !failed;
+}
+
+#ifdef HAVE_ALSA
+AlsaSink::AlsaSink() : pcm(nullptr)
+{
+}
+
+AlsaSink::~AlsaSink()
+{
+    if (pcm)
+    {
+        snd_pcm_close(static_cast<snd_pcm_t*>(pcm));
+    }
+}
+
+bool AlsaSink::open(uint32_t rate)
+{
+    snd_pcm_t* handle;
+    if (snd_pcm_open(&handle, "default", SND_PCM_STREAM_PLAYBACK, 0) < 0)
+    {
+        return false;
+    }
+    // 50 ms of device buffer
+    if (snd_pcm_set_params(handle, SND_PCM_FORMAT_S16, SND_PCM_ACCESS_RW_INTERLEAVED, 1, rate, 1, 50000) < 0)
+    {
+        snd_pcm_close(handle);
+        return false;
+    }
+    pcm = handle;
+    return true;
+}
+
+bool AlsaSink::write(const int16_t* samples, size_t count)
+{
+    snd_pcm_t* handle = static_cast<snd_pcm_t*>(pcm);
+    while (count)
+    {
+        snd_pcm_sframes_t written = snd_pcm_writei(handle, samples, count);
+        if (written < 0)
+        {
+            // Recover from underruns, give up on anything else
+            if (snd_pcm_recover(handle, written, 1) < 0)
+            {
+                return false;
+            }
+            continue;
+        }
+        samples += written;
+        count -= written;
+    }
+    return true;
+}
+#endif
+
+SampleRing::SampleRing(size_t capacity)
+{
+    size_t size = 1;
+    while (size < capacity)
+    {
+        size <<= 1;
+    }
+    ring.resize(size);
+    mask = size - 1;
+}
+
+size_t SampleRing::push(const int16_t* samples, size_t count)
+{
+    uint64_t h = head.load(std::memory_order_relaxed);
+    uint64_t t = tail.load(std::memory_order_acquire);
+    count = std::min<uint64_t>(count, ring.size() - (h - t));
+    for (size_t i = 0; i < count; i++)
+    {
+        ring[(h + i) & mask] = samples[i];
+    }
+    head.store(h + count, std::memory_order_release);
+    return count;
+}
+
+size_t SampleRing::pop(int16_t* samples, size_t count)
+{
+    uint64_t t = tail.load(std::memory_order_relaxed);
+    uint64_t h = head.load(std::memory_order_acquire);
+    count = std::min<uint64_t>(count, h - t);
+    for (size_t i = 0; i < count; i++)
+    {
+        samples[i] = ring[(t + i) & mask];
+    }
+    tail.store(t + count, std::memory_order_release);
+    return count;
+}
+
+size_t SampleRing::size() const
+{
+    return head.load(std::memory_order_acquire) - tail.load(std::memory_order_acquire);
+}
+
+Audio::Audio(std::unique_ptr<AudioSink> s, uint32_t sampleRate, uint32_t tone)
+    : sink(std::move(s)), rate(sampleRate), frequency(tone), ticks(0), phase(0), position(0), lost(0),
+      ring(ringSamples), stopping(false)
+{
+    if (sink->realtime())
+    {
+        player = std::thread(&Audio::play, this);
+    }
+}
+
+Audio::~Audio()
+{
+    if (player.joinable())
+    {
+        stopping = true;
+        player.join();
+    }
+}
+
+void Audio::tick(uint8_t sound, const uint8_t* pattern, uint8_t pitch)
+{
+    // Samples from the start of this tick to the start of the next
+    const uint64_t begin = ticks * rate / 60;
+    const uint64_t end = (ticks + 1) * rate / 60;
+    ticks++;
+    buffer.resize(end - begin);
+    // Pattern bits per sample, 4000 bits a second at pitch 64
+    const double step = 4000.0 * std::exp2((pitch - 64) / 48.0) / rate;
+    for (int16_t& sample : buffer)
+    {
+        if (sound && pattern)
+        {
+            const int bit = (int)position;
+            sample = ((pattern[bit >> 3] >> (7 - (bit & 7))) & 1) ? amplitude : -amplitude;
+            position = std::fmod(position + step, 128.0);
+        }
+        else if (sound)
+        {
+            // Half periods of the tone, counted from where it started
+            sample = ((phase * 2 * frequency / rate) & 1) ? -amplitude : amplitude;
+            phase++;
+        }
+        else
+        {
+            sample = 0;
+        }
+    }
+    if (!sound)
+    {
+        phase = 0;
+        position = 0;
+    }
+
+    if (player.joinable())
+    {
+        lost += buffer.size() - ring.push(buffer.data(), buffer.size());
+    }
+    else
+    {
+        sink->write(buffer.data(), buffer.size());
+    }
+}
+
+// Runs on its own thread for real-time sinks. The sink's blocking writes set
+// the pace; silence covers the gaps when the machine falls behind
+void Audio::play()
+{
+    int16_t chunk[chunkSamples];
+    while (!stopping)
+    {
+        size_t n = ring.pop(chunk, chunkSamples);
+        if (n == 0)
+        {
+            std::fill(chunk, chunk + chunkSamples, 0);
+            n = chunkSamples;
+        }
+        if (!sink->write(chunk, n))
+        {
+            break;
+        }
+    }
+}
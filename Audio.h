@@ -0,0 +1,126 @@
+#pragma once
+
+#include <atomic>
+#include <cstdint>
+#include <cstddef>
+#include <cstdio>
+#include <memory>
+#include <string>
+#include <thread>
+#include <vector>
+
+#include "Chip8.h"
+
+// Where generated samples end up. Samples are signed 16 bit mono.
+class AudioSink
+{
+public:
+    virtual ~AudioSink() {}
+    virtual bool write(const int16_t* samples, size_t count) = 0;
+    // A real-time sink plays at wall clock speed and is fed from a thread;
+    // other sinks take samples as fast as the machine produces them
+    virtual bool realtime() const = 0;
+};
+
+// Writes a 16 bit mono PCM .wav file, for headless runs
+class WavSink : public AudioSink
+{
+public:
+    WavSink();
+    ~WavSink();
+    bool open(const std::string& filename, uint32_t rate);
+    // Fill in the sizes in the header. Returns false if any write failed
+    bool close();
+    bool write(const int16_t* samples, size_t count) override;
+    bool realtime() const override { return false; }
+
+private:
+    std::FILE* file;
+    uint32_t rate;
+    uint64_t bytes;
+    bool failed;
+    void writeHeader();
+};
+
+#ifdef HAVE_ALSA
+// Plays on the default ALSA device
+class AlsaSink : public AudioSink
+{
+public:
+    AlsaSink();
+    ~AlsaSink();
+    bool open(uint32_t rate);
+    bool write(const int16_t* samples, size_t count) override;
+    bool realtime() const override { return true; }
+
+private:
+    // snd_pcm_t, kept opaque so users don't need the ALSA headers
+    void* pcm;
+};
+#endif
+
+// Single-producer single-consumer ring of samples. Neither side ever waits
+// for the other: push() drops what does not fit and pop() returns what is
+// there.
+class SampleRing
+{
+public:
+    // Rounded up to a power of two
+    explicit SampleRing(size_t capacity);
+    // Returns how many samples were stored
+    size_t push(const int16_t* samples, size_t count);
+    size_t pop(int16_t* samples, size_t count);
+    size_t size() const;
+
+private:
+    std::vector<int16_t> ring;
+    size_t mask;
+    alignas(64) std::atomic<uint64_t> head {0};
+    alignas(64) std::atomic<uint64_t> tail {0};
+};
+
+// The CHIP-8 buzzer: a square wave that is on for every 60 Hz tick the sound
+// timer is non-zero. Tick k starts at sample k * rate / 60, so the on and off
+// edges fall on exact sample positions and the stream never drifts from the
+// timer clock. Once an XO-CHIP program loaded an audio pattern the pattern
+// plays instead of the tone, looping at the rate its pitch asks for. Install
+// with
+//   machine.tickHook = Audio::onTick; machine.tickCtx = &audio;
+// Samples go through a SampleRing to a real-time sink on its own thread, or
+// straight to a sink that is not real time.
+class Audio
+{
+public:
+    Audio(std::unique_ptr<AudioSink> sink, uint32_t rate = 44100, uint32_t frequency = 700);
+    ~Audio();
+    Audio(const Audio&) = delete;
+    Audio& operator=(const Audio&) = delete;
+
+    // Generate one tick of sound, on if `sound` is non-zero. Plays the 16 byte
+    // `pattern` at `pitch` if there is one, else the tone.
+    void tick(uint8_t sound, const uint8_t* pattern = nullptr, uint8_t pitch = 64);
+    static void onTick(void* audio, const Chip8& m)
+    {
+        static_cast<Audio*>(audio)->tick(m.sound, m.patternLoaded ? m.audioPattern.data() : nullptr, m.pitch);
+    }
+
+    // Samples a real-time sink missed because the ring was full
+    uint64_t dropped() const { return lost; }
+
+private:
+    std::unique_ptr<AudioSink> sink;
+    uint32_t rate;
+    uint32_t frequency;
+    uint64_t ticks;
+    // Samples since the tone started
+    uint64_t phase;
+    // Bit of the pattern playing, with the fraction of it already played
+    double position;
+    uint64_t lost;
+    std::vector<int16_t> buffer;
+    SampleRing ring;
+    std::atomic<bool> stopping;
+    std::thread player;
+
+    void play();
+};
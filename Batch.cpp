@@ -0,0 +1,214 @@
+#include "Batch.h"
+#include "Chip8.h"
+#include "Rom.h"
+
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <cstdio>
+#include <cstdlib>
+#include <deque>
+#include <fstream>
+#include <memory>
+#include <mutex>
+#include <sstream>
+#include <thread>
+
+namespace
+{
+    // Per-worker job queue. The owner takes jobs from the back, idle workers
+    // steal from the front.
+    struct WorkQueue
+    {
+        std::mutex lock;
+        std::deque<size_t> jobs;
+    };
+
+    bool takeJob(std::vector<WorkQueue>& queues, unsigned self, size_t& job)
+    {
+        {
+            std::lock_guard<std::mutex> guard(queues[self].lock);
+            if (!queues[self].jobs.empty())
+            {
+                job = queues[self].jobs.back();
+                queues[self].jobs.pop_back();
+                return true;
+            }
+        }
+        for (size_t i = 1; i < queues.size(); i++)
+        {
+            WorkQueue& victim = queues[(self + i) % queues.size()];
+            std::lock_guard<std::mutex> guard(victim.lock);
+            if (!victim.jobs.empty())
+            {
+                job = victim.jobs.front();
+                victim.jobs.pop_front();
+                return true;
+            }
+        }
+        return false;
+    }
+
+    bool readInput(const std::string& filename, std::vector<uint16_t>& keys)
+    {
+        std::ifstream in(filename);
+        if (!in)
+        {
+            return false;
+        }
+        unsigned int mask;
+        while (in >> std::hex >> mask)
+        {
+            keys.push_back(mask);
+        }
+        return true;
+    }
+
+    std::string jsonString(const std::string& s)
+    {
+        std::string out = "\"";
+        for (char c : s)
+        {
+            if (c == '"' || c == '\\')
+            {
+                out += '\\';
+                out += c;
+            }
+            else if ((unsigned char)c < 0x20)
+            {
+                char buf[8];
+                std::snprintf(buf, sizeof(buf), "\\u%04x", c);
+                out += buf;
+            }
+            else
+            {
+                out += c;
+            }
+        }
+        return out + "\"";
+    }
+}
+
+bool readBatchJobs(const std::string& filename, std::vector<BatchJob>& jobs, std::string& error)
+{
+    std::ifstream in(filename);
+    if (!in)
+    {
+        error = "could not open " + filename;
+        return false;
+    }
+    std::string line;
+    int lineNumber = 0;
+    while (std::getline(in, line))
+    {
+        lineNumber++;
+        std::istringstream fields(line);
+        BatchJob job;
+        if (!(fields >> job.rom) || job.rom[0] == '#')
+        {
+            continue;
+        }
+        std::string cycles, seed;
+        fields >> cycles >> seed >> job.input;
+        char* end = nullptr;
+        if (!cycles.empty())
+        {
+            job.cycles = std::strtoull(cycles.c_str(), &end, 0);
+        }
+        if (!seed.empty() && (!end || *end == '\0'))
+        {
+            job.seed = std::strtoul(seed.c_str(), &end, 0);
+        }
+        if (end && *end != '\0')
+        {
+            error = filename + ":" + std::to_string(lineNumber) + ": expected <rom> [cycles] [seed] [input]";
+            return false;
+        }
+        jobs.push_back(job);
+    }
+    return true;
+}
+
+size_t runBatch(const std::vector<BatchJob>& jobs, const BatchOptions& options, std::ostream& out)
+{
+    unsigned threads = options.threads ? options.threads : std::thread::hardware_concurrency();
+    threads = std::max(1u, std::min<unsigned>(threads, jobs.size()));
+
+    std::vector<WorkQueue> queues(threads);
+    for (size_t i = 0; i < jobs.size(); i++)
+    {
+        queues[i % threads].jobs.push_back(i);
+    }
+
+    std::mutex outLock;
+    std::atomic<size_t> failed {0};
+    // Shared by the workers, so each ROM is read and analysed once
+    std::unique_ptr<RomCache> cache;
+    if (!options.cacheDir.empty())
+    {
+        cache.reset(new RomCache(options.cacheDir));
+    }
+    auto worker = [&](unsigned self)
+    {
+        // One machine per worker, reset between jobs
+        std::unique_ptr<Chip8> machine(new Chip8);
+        machine->setQuirks(options.quirks);
+        if (options.jit)
+        {
+            machine->enableJit();
+        }
+        std::vector<uint16_t> keys;
+        size_t index;
+        while (takeJob(queues, self, index))
+        {
+            const BatchJob& job = jobs[index];
+            std::ostringstream line;
+            line << "{\"job\":" << index << ",\"rom\":" << jsonString(job.rom) << ",\"seed\":" << job.seed;
+
+            keys.clear();
+            machine->reset();
+            machine->seed(job.seed);
+            std::string error;
+            bool loaded = cache ? cache->load(job.rom, *machine, error) : machine->loadFile(job.rom);
+            if (!loaded || (!job.input.empty() && !readInput(job.input, keys)))
+            {
+                failed++;
+                line << ",\"error\":\"could not load rom or input\"}";
+            }
+            else
+            {
+                auto start = std::chrono::steady_clock::now();
+                uint64_t frame = 0;
+                while (!machine->done && machine->cycles < job.cycles)
+                {
+                    machine->keys = frame < keys.size() ? keys[frame] : 0;
+                    machine->runFrame(std::min(job.cycles - machine->cycles, options.instructionsPerFrame));
+                    frame++;
+                }
+                std::chrono::duration<double> elapsed = std::chrono::steady_clock::now() - start;
+
+                char hash[17];
+                std::snprintf(hash, sizeof(hash), "%016llx", (unsigned long long)machine->screenHash());
+                line << ",\"cycles\":" << machine->cycles << ",\"frames\":" << frame
+                    << ",\"exit\":\"" << (machine->done ? Chip8::exitName((Chip8::ExitReason)machine->exitReason) : "cycle-limit")
+                    << "\",\"screen\":\"" << hash << "\",\"seconds\":" << elapsed.count() << "}";
+            }
+
+            std::lock_guard<std::mutex> guard(outLock);
+            out << line.str() << '\n';
+            out.flush();
+        }
+    };
+
+    std::vector<std::thread> pool;
+    for (unsigned t = 1; t < threads; t++)
+    {
+        pool.emplace_back(worker, t);
+    }
+    worker(0);
+    for (auto &&t : pool)
+    {
+        t.join();
+    }
+    return failed;
+}
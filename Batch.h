@@ -0,0 +1,40 @@
+#pragma once
+
+#include <cstdint>
+#include <iosfwd>
+#include <string>
+#include <vector>
+
+#include "Chip8.h"
+
+// Runs many headless ROM jobs on a work-stealing thread pool and streams one
+// JSON line per finished job.
+//
+// Job files have one job per line: `<rom> [cycles] [seed] [input]`, where
+// input is a text file of hexadecimal key masks, one per 60 Hz frame.
+// Blank lines and lines starting with # are ignored.
+struct BatchJob
+{
+    std::string rom;
+    uint64_t cycles = 1000000;
+    uint32_t seed = 1;
+    std::string input;
+};
+
+struct BatchOptions
+{
+    // 0 means one worker per host core
+    unsigned threads = 0;
+    uint64_t instructionsPerFrame = 11;
+    bool jit = false;
+    Chip8::QuirkProfile quirks = Chip8::QuirksModern;
+    // Load ROMs through a RomCache in this directory, see Rom.h
+    std::string cacheDir;
+};
+
+// Returns false and sets `error` if the file cannot be read or parsed
+bool readBatchJobs(const std::string& filename, std::vector<BatchJob>& jobs, std::string& error);
+
+// Runs every job and writes its result to `out` as soon as it finishes.
+// Returns the number of jobs that could not be started (e.g. missing ROM).
+size_t runBatch(const std::vector<BatchJob>& jobs, const BatchOptions& options, std::ostream& out);
@@ -0,0 +1,1455 @@
+#include "Chip8.h"
+#include "Aot.h"
+#include "Jit.h"
+#include "Profile.h"
+#include "Rom.h"
+#include "Trace.h"
+
+#include <algorithm>
+#include <cstdlib>
+#include <cstring>
+
+#ifdef __SSE2__
+#include <immintrin.h>
+#endif
+
+#ifdef DEBUG
+#include <iomanip>
+#include <iostream>
+#include <sstream>
+#endif
+
+const uint8_t Chip8::font[80] = {
+    0xf0, 0x90, 0x90, 0x90, 0xf0, //0
+    0x20, 0x60, 0x20, 0x20, 0x70,
+    0xf0, 0x10, 0xf0, 0x80, 0xf0,
+    0xf0, 0x10, 0xf0, 0x10, 0xf0,
+    0x90, 0x90, 0xf0, 0x10, 0x10,
+    0xf0, 0x80, 0xf0, 0x10, 0xf0,
+    0xf0, 0x80, 0xf0, 0x90, 0xf0,
+    0xf0, 0x10, 0x20, 0x40, 0x40,
+    0xf0, 0x90, 0xf0, 0x90, 0xf0,
+    0xf0, 0x90, 0xf0, 0x10, 0xf0,
+    0xf0, 0x90, 0xf0, 0x90, 0x90,
+    0xe0, 0x90, 0xe0, 0x90, 0xe0,
+    0xf0, 0x80, 0x80, 0x80, 0xf0,
+    0xe0, 0x90, 0x90, 0x90, 0xe0,
+    0xf0, 0x80, 0xf0, 0x80, 0xf0,
+    0xf0, 0x80, 0xf0, 0x80, 0x80  //F
+};
+
+const uint8_t Chip8::bigFont[160] = {
+    0xff, 0xff, 0xc3, 0xc3, 0xc3, 0xc3, 0xc3, 0xc3, 0xff, 0xff, //0
+    0x18, 0x78, 0x78, 0x18, 0x18, 0x18, 0x18, 0x18, 0xff, 0xff,
+    0xff, 0xff, 0x03, 0x03, 0xff, 0xff, 0xc0, 0xc0, 0xff, 0xff,
+    0xff, 0xff, 0x03, 0x03, 0xff, 0xff, 0x03, 0x03, 0xff, 0xff,
+    0xc3, 0xc3, 0xc3, 0xc3, 0xff, 0xff, 0x03, 0x03, 0x03, 0x03,
+    0xff, 0xff, 0xc0, 0xc0, 0xff, 0xff, 0x03, 0x03, 0xff, 0xff,
+    0xff, 0xff, 0xc0, 0xc0, 0xff, 0xff, 0xc3, 0xc3, 0xff, 0xff,
+    0xff, 0xff, 0x03, 0x03, 0x06, 0x0c, 0x18, 0x18, 0x18, 0x18,
+    0xff, 0xff, 0xc3, 0xc3, 0xff, 0xff, 0xc3, 0xc3, 0xff, 0xff,
+    0xff, 0xff, 0xc3, 0xc3, 0xff, 0xff, 0x03, 0x03, 0xff, 0xff,
+    0x7e, 0xff, 0xc3, 0xc3, 0xc3, 0xff, 0xff, 0xc3, 0xc3, 0xc3,
+    0xfc, 0xfc, 0xc3, 0xc3, 0xfc, 0xfc, 0xc3, 0xc3, 0xfc, 0xfc,
+    0x3c, 0xff, 0xc3, 0xc0, 0xc0, 0xc0, 0xc0, 0xc3, 0xff, 0x3c,
+    0xfc, 0xfe, 0xc3, 0xc3, 0xc3, 0xc3, 0xc3, 0xc3, 0xfe, 0xfc,
+    0xff, 0xff, 0xc0, 0xc0, 0xff, 0xff, 0xc0, 0xc0, 0xff, 0xff,
+    0xff, 0xff, 0xc0, 0xc0, 0xff, 0xff, 0xc0, 0xc0, 0xc0, 0xc0  //F
+};
+
+namespace
+{
+    // XOR sprite rows onto a screen of Width x Height pixels in the top left
+    // of the frame buffer
+    template<bool Clip, int Width, int Height>
+    Chip8::Row drawRows(Chip8& m, uint8_t x, uint8_t y, const Chip8::Row* rows, uint8_t height, int plane)
+    {
+        x %= Width;
+        y %= Height;
+        Chip8::Row collision = 0;
+        for (uint8_t i = 0; i < height; i++)
+        {
+            Chip8::Row sprite;
+            int r;
+            if constexpr (Clip)
+            {
+                if (y + i >= Height)
+                {
+                    break;
+                }
+                // Shifting instead of rotating drops the pixels past the right edge
+                sprite = rows[i] >> x;
+                r = y + i;
+            }
+            else if constexpr (Width == Chip8::LowResWidth)
+            {
+                // Rotate within the left half, which is the whole low resolution row
+                sprite = (Chip8::Row)std::rotr((uint64_t)(rows[i] >> 64), x) << 64;
+                r = (y + i) % Height;
+            }
+            else
+            {
+                sprite = x ? (rows[i] >> x) | (rows[i] << (Width - x)) : rows[i];
+                r = (y + i) % Height;
+            }
+            if constexpr (Width == Chip8::LowResWidth)
+            {
+                sprite &= ~(Chip8::Row)0 << 64;
+            }
+            collision |= m.pixels[plane][r] & sprite;
+            m.pixels[plane][r] ^= sprite;
+            m.dirtyRows |= 1ULL << r;
+        }
+        return collision;
+    }
+
+    // Shift `count` rows 4 pixels sideways, a whole 128-bit row at a time.
+    // Pixels pushed past the edge of the screen are dropped, including into
+    // the unused right half of a low resolution row.
+    template<bool Right>
+    void shiftRows(Chip8::Row* rows, int count, bool hires)
+    {
+        #ifdef __SSE2__
+        // Rows are little endian: the high quadword is the left half
+        const __m128i keep = _mm_set_epi64x(-1, hires ? -1 : 0);
+        for (int r = 0; r < count; r++)
+        {
+            __m128i* p = reinterpret_cast<__m128i*>(&rows[r]);
+            __m128i v = _mm_load_si128(p);
+            if constexpr (Right)
+            {
+                v = _mm_or_si128(_mm_srli_epi64(v, 4), _mm_slli_epi64(_mm_srli_si128(v, 8), 60));
+            }
+            else
+            {
+                v = _mm_or_si128(_mm_slli_epi64(v, 4), _mm_srli_epi64(_mm_slli_si128(v, 8), 60));
+            }
+            _mm_store_si128(p, _mm_and_si128(v, keep));
+        }
+        #else
+        const Chip8::Row keep = hires ? ~(Chip8::Row)0 : ~(Chip8::Row)0 << 64;
+        for (int r = 0; r < count; r++)
+        {
+            rows[r] = (Right ? rows[r] >> 4 : rows[r] << 4) & keep;
+        }
+        #endif
+    }
+}
+
+Chip8::Chip8()
+{
+    tickHook = nullptr;
+    tickCtx = nullptr;
+    // 700 instructions per second
+    instructionsPerTick = 11;
+    quirkProfile = QuirksModern;
+    memory = classicMemory.data();
+    decoded = classicDecoded.data();
+    jit = nullptr;
+    aot = nullptr;
+    rngState = 0x2545f491;
+    reset();
+}
+
+Chip8::~Chip8()
+{
+    if (memory != classicMemory.data())
+    {
+        delete[] memory;
+        delete[] decoded;
+    }
+    delete jit;
+    delete aot;
+}
+
+bool Chip8::enableJit()
+{
+    if (!jit)
+    {
+        jit = new Jit(*this);
+    }
+    if (!jit->available())
+    {
+        delete jit;
+        jit = nullptr;
+        return false;
+    }
+    return true;
+}
+
+bool Chip8::enableAot(const AotProgram& program)
+{
+    if (quirkTable[program.quirks].xoChip)
+    {
+        return false;
+    }
+    delete aot;
+    aot = new Aot(*this, program);
+    return true;
+}
+
+void Chip8::reset()
+{
+    regs.fill(0);
+    stack.fill(0);
+    const size_t size = memorySize();
+    std::fill_n(memory, size, 0);
+    dirtyPages.fill(~0ULL);
+    clearScreen();
+    std::copy(font, font+80, memory);
+    std::copy(bigFont, bigFont+160, memory + BigFontStart);
+    userFlags.fill(0);
+    audioPattern.fill(0);
+    pitch = 64;
+    patternLoaded = false;
+    for (size_t a = 0; a < size; a++)
+    {
+        decoded[a].handler = OpNotDecoded;
+    }
+    if (jit)
+    {
+        jit->flush();
+    }
+    addrptr = ProgramStart;
+    memptr = 0;
+    delay = 0;
+    sound = 0;
+    sp = 0;
+    done = false;
+    hires = false;
+    planeMask = 1;
+    exitReason = ExitRunning;
+    waitingForKey = false;
+    keys = 0;
+    lastKeys = 0;
+    cycles = 0;
+}
+
+void Chip8::seed(uint32_t s)
+{
+    // xorshift32 must never be seeded with zero
+    rngState = s ? s : 0x2545f491;
+}
+
+uint8_t Chip8::random()
+{
+    rngState ^= rngState << 13;
+    rngState ^= rngState >> 17;
+    rngState ^= rngState << 5;
+    return rngState >> 24;
+}
+
+bool Chip8::load(const uint8_t* data, size_t size)
+{
+    if (size > maxRomSize(quirkProfile))
+    {
+        return false;
+    }
+    std::copy(data, data+size, memory + ProgramStart);
+    written(ProgramStart, size);
+    return true;
+}
+
+bool Chip8::loadFile(const std::string& filename)
+{
+    RomFile rom;
+    std::string error;
+    return rom.open(filename, error) && load(rom.data(), rom.size());
+}
+
+void Chip8::tick()
+{
+    if (tickHook)
+    {
+        tickHook(tickCtx, *this);
+    }
+    if (delay > 0)
+    {
+        delay--;
+    }
+    if (sound > 0)
+    {
+        sound--;
+    }
+}
+
+void Chip8::clearScreen()
+{
+    clearPlanes((1 << Planes) - 1);
+}
+
+void Chip8::clearPlanes(uint8_t planes)
+{
+    for (int p = 0; p < Planes; p++)
+    {
+        if (planes & (1 << p))
+        {
+            std::memset(pixels[p].data(), 0, sizeof(pixels[p]));
+        }
+    }
+    dirtyRows = ~0ULL;
+}
+
+void Chip8::setHires(bool on)
+{
+    hires = on;
+    clearScreen();
+}
+
+template<bool Clip>
+bool Chip8::drawSprite(uint8_t x, uint8_t y, const Row* rows, uint8_t height, int plane)
+{
+    Row collision = hires ? drawRows<Clip, ScreenWidth, ScreenHeight>(*this, x, y, rows, height, plane)
+        : drawRows<Clip, LowResWidth, LowResHeight>(*this, x, y, rows, height, plane);
+    return collision != 0;
+}
+
+template bool Chip8::drawSprite<false>(uint8_t, uint8_t, const Row*, uint8_t, int);
+template bool Chip8::drawSprite<true>(uint8_t, uint8_t, const Row*, uint8_t, int);
+
+template<bool Clip, size_t Size>
+bool Chip8::drawFromMemory(uint8_t x, uint8_t y, uint16_t source, uint8_t n)
+{
+    constexpr uint16_t mask = Size - 1;
+    bool collision = false;
+    for (int plane = 0; plane < Planes; plane++)
+    {
+        if (!(planeMask & (1 << plane)))
+        {
+            continue;
+        }
+        Row rows[16];
+        if (n)
+        {
+            for (uint8_t i = 0; i < n; i++)
+            {
+                rows[i] = (Row)memory[(source+i) & mask] << (ScreenWidth - 8);
+            }
+        }
+        else
+        {
+            for (uint8_t i = 0; i < 16; i++)
+            {
+                uint16_t bits = ((uint16_t)memory[(source+2*i) & mask] << 8) | memory[(source+2*i+1) & mask];
+                rows[i] = (Row)bits << (ScreenWidth - 16);
+            }
+        }
+        collision |= drawSprite<Clip>(x, y, rows, n ? n : 16, plane);
+        source += n ? n : 32;
+    }
+    return collision;
+}
+
+template bool Chip8::drawFromMemory<false, Chip8::MemorySize>(uint8_t, uint8_t, uint16_t, uint8_t);
+template bool Chip8::drawFromMemory<true, Chip8::MemorySize>(uint8_t, uint8_t, uint16_t, uint8_t);
+template bool Chip8::drawFromMemory<false, Chip8::ClassicMemorySize>(uint8_t, uint8_t, uint16_t, uint8_t);
+template bool Chip8::drawFromMemory<true, Chip8::ClassicMemorySize>(uint8_t, uint8_t, uint16_t, uint8_t);
+
+void Chip8::scrollDown(uint8_t n)
+{
+    const int rows = height();
+    n = std::min<int>(n, rows);
+    for (int p = 0; p < Planes; p++)
+    {
+        if (planeMask & (1 << p))
+        {
+            std::memmove(&pixels[p][n], &pixels[p][0], (rows - n) * sizeof(Row));
+            std::memset(&pixels[p][0], 0, n * sizeof(Row));
+        }
+    }
+    dirtyRows |= ~0ULL >> (64 - rows);
+}
+
+void Chip8::scrollUp(uint8_t n)
+{
+    const int rows = height();
+    n = std::min<int>(n, rows);
+    for (int p = 0; p < Planes; p++)
+    {
+        if (planeMask & (1 << p))
+        {
+            std::memmove(&pixels[p][0], &pixels[p][n], (rows - n) * sizeof(Row));
+            std::memset(&pixels[p][rows - n], 0, n * sizeof(Row));
+        }
+    }
+    dirtyRows |= ~0ULL >> (64 - rows);
+}
+
+void Chip8::scrollRight()
+{
+    for (int p = 0; p < Planes; p++)
+    {
+        if (planeMask & (1 << p))
+        {
+            shiftRows<true>(pixels[p].data(), height(), hires);
+        }
+    }
+    dirtyRows |= ~0ULL >> (64 - height());
+}
+
+void Chip8::scrollLeft()
+{
+    for (int p = 0; p < Planes; p++)
+    {
+        if (planeMask & (1 << p))
+        {
+            shiftRows<false>(pixels[p].data(), height(), hires);
+        }
+    }
+    dirtyRows |= ~0ULL >> (64 - height());
+}
+
+uint64_t Chip8::runFrame(uint64_t n)
+{
+    uint64_t executed = step(n);
+    tick();
+    return executed;
+}
+
+uint64_t Chip8::advance(uint64_t n)
+{
+    const uint64_t start = cycles;
+    const uint64_t target = cycles + n;
+    const uint64_t period = std::max<uint64_t>(instructionsPerTick, 1);
+    while (cycles < target && !done)
+    {
+        uint64_t boundary = (cycles / period + 1) * period;
+        step(std::min(target, boundary) - cycles);
+        if (cycles != boundary)
+        {
+            break;
+        }
+        tick();
+    }
+    return cycles - start;
+}
+
+uint64_t Chip8::screenHash() const
+{
+    // FNV-1a over the visible part of the rows, so a low resolution screen
+    // hashes the same as it did with 64 pixel rows. The second plane only
+    // counts once something was drawn on it.
+    uint64_t h = 0xcbf29ce484222325;
+    for (int p = 0; p < Planes; p++)
+    {
+        if (p > 0 && std::all_of(pixels[p].begin(), pixels[p].end(), [](Row row) { return row == 0; }))
+        {
+            break;
+        }
+        for (int r = 0; r < height(); r++)
+        {
+            for (int b = ScreenWidth - width(); b < ScreenWidth; b += 8)
+            {
+                h = (h ^ (uint8_t)(pixels[p][r] >> b)) * 0x100000001b3;
+            }
+        }
+    }
+    return h;
+}
+
+const char* Chip8::exitName(ExitReason r)
+{
+    switch (r)
+    {
+    case ExitRunning: return "running";
+    case ExitReturnEmptyStack: return "return-empty-stack";
+    case ExitStackOverflow: return "stack-overflow";
+    case ExitPcOutOfRange: return "pc-out-of-range";
+    case ExitQuit: return "quit";
+    case ExitProgram: return "exit";
+    }
+    return "unknown";
+}
+
+void Chip8::setQuirks(QuirkProfile p)
+{
+    if (p == quirkProfile)
+    {
+        return;
+    }
+    const bool wasXoChip = quirks().xoChip;
+    quirkProfile = p;
+    if (quirks().xoChip && !wasXoChip)
+    {
+        uint8_t* large = new uint8_t[MemorySize]();
+        std::copy(classicMemory.begin(), classicMemory.end(), large);
+        memory = large;
+        decoded = new DecodedOp[MemorySize];
+    }
+    else if (wasXoChip && !quirks().xoChip)
+    {
+        // Memory beyond 4 KB can not be addressed any more
+        std::copy(memory, memory + ClassicMemorySize, classicMemory.begin());
+        delete[] memory;
+        delete[] decoded;
+        memory = classicMemory.data();
+        decoded = classicDecoded.data();
+    }
+    if (quirks().xoChip != wasXoChip)
+    {
+        const size_t size = memorySize();
+        for (size_t a = 0; a < size; a++)
+        {
+            decoded[a].handler = OpNotDecoded;
+        }
+        dirtyPages.fill(~0ULL);
+    }
+    // Translated code has the old quirks built in
+    if (jit)
+    {
+        jit->flush();
+    }
+}
+
+const char* Chip8::quirkName(QuirkProfile p)
+{
+    switch (p)
+    {
+    case QuirksModern: return "modern";
+    case QuirksVip: return "vip";
+    case QuirksChip48: return "chip48";
+    case QuirksSchip: return "schip";
+    case QuirksXoChip: return "xochip";
+    case QuirkProfileCount: break;
+    }
+    return "unknown";
+}
+
+bool Chip8::parseQuirks(const std::string& name, QuirkProfile& p)
+{
+    for (uint8_t i = 0; i < QuirkProfileCount; i++)
+    {
+        if (name == quirkName((QuirkProfile)i))
+        {
+            p = (QuirkProfile)i;
+            return true;
+        }
+    }
+    return false;
+}
+
+uint64_t Chip8::runUntil(uint64_t target)
+{
+    if (target <= cycles)
+    {
+        return 0;
+    }
+    return step(target - cycles);
+}
+
+Chip8::DecodedOp Chip8::decode(uint16_t inst)
+{
+    DecodedOp op;
+    op.handler = OpUndefined;
+    op.x = (inst & 0x0f00) >> 8;
+    op.y = (inst & 0x00f0) >> 4;
+    op.n = inst & 0x000f;
+    op.nn = inst & 0x00ff;
+    op.nnn = inst & 0x0fff;
+
+    switch (inst & 0xf000)
+    {
+    case 0x0000:
+        if (inst == 0x00e0)
+        {
+            op.handler = OpClear;
+        }
+        else if (inst == 0x00ee)
+        {
+            op.handler = OpReturn;
+        }
+        else if ((inst & 0xfff0) == 0x00c0)
+        {
+            op.handler = OpScrollDown;
+        }
+        else if (inst == 0x00fb)
+        {
+            op.handler = OpScrollRight;
+        }
+        else if (inst == 0x00fc)
+        {
+            op.handler = OpScrollLeft;
+        }
+        else if (inst == 0x00fd)
+        {
+            op.handler = OpExit;
+        }
+        else if (inst == 0x00fe)
+        {
+            op.handler = OpLowRes;
+        }
+        else if (inst == 0x00ff)
+        {
+            op.handler = OpHighRes;
+        }
+        else if ((inst & 0xfff0) == 0x00d0)
+        {
+            op.handler = OpScrollUp;
+        }
+        // 0NNN machine language subroutine is not supported
+        break;
+    case 0x1000: op.handler = OpJump; break;
+    case 0x2000: op.handler = OpCall; break;
+    case 0x3000: op.handler = OpSkipEqImm; break;
+    case 0x4000: op.handler = OpSkipNeqImm; break;
+    case 0x5000:
+        if (op.n == 0)
+        {
+            op.handler = OpSkipEqReg;
+        }
+        else if (op.n == 2)
+        {
+            op.handler = OpSaveRange;
+        }
+        else if (op.n == 3)
+        {
+            op.handler = OpLoadRange;
+        }
+        break;
+    case 0x6000: op.handler = OpLoadImm; break;
+    case 0x7000: op.handler = OpAddImm; break;
+    case 0x8000:
+        switch (op.n)
+        {
+        case 0x0: op.handler = OpMove; break;
+        case 0x1: op.handler = OpOr; break;
+        case 0x2: op.handler = OpAnd; break;
+        case 0x3: op.handler = OpXor; break;
+        case 0x4: op.handler = OpAdd; break;
+        case 0x5: op.handler = OpSub; break;
+        case 0x6: op.handler = OpShiftRight; break;
+        case 0x7: op.handler = OpSubReverse; break;
+        case 0xe: op.handler = OpShiftLeft; break;
+        }
+        break;
+    case 0x9000:
+        if (op.n == 0)
+        {
+            op.handler = OpSkipNeqReg;
+        }
+        break;
+    case 0xa000: op.handler = OpLoadI; break;
+    case 0xb000: op.handler = OpJumpOffset; break;
+    case 0xc000: op.handler = OpRandom; break;
+    case 0xd000: op.handler = op.n ? OpDraw : OpDrawLarge; break;
+    case 0xe000:
+        if (op.nn == 0x9e)
+        {
+            op.handler = OpSkipKey;
+        }
+        else if (op.nn == 0xa1)
+        {
+            op.handler = OpSkipNotKey;
+        }
+        break;
+    case 0xf000:
+        if (inst == 0xf000)
+        {
+            op.handler = OpLongI;
+            break;
+        }
+        if (inst == 0xf002)
+        {
+            op.handler = OpAudio;
+            break;
+        }
+        switch (op.nn)
+        {
+        case 0x01: op.handler = OpPlanes; break;
+        case 0x07: op.handler = OpGetDelay; break;
+        case 0x0a: op.handler = OpWaitKey; break;
+        case 0x15: op.handler = OpSetDelay; break;
+        case 0x18: op.handler = OpSetSound; break;
+        case 0x1e: op.handler = OpAddI; break;
+        case 0x29: op.handler = OpFont; break;
+        case 0x30: op.handler = OpBigFont; break;
+        case 0x33: op.handler = OpBcd; break;
+        case 0x3a: op.handler = OpPitch; break;
+        case 0x55: op.handler = OpStore; break;
+        case 0x65: op.handler = OpLoad; break;
+        case 0x75: op.handler = OpSaveFlags; break;
+        case 0x85: op.handler = OpLoadFlags; break;
+        }
+        break;
+    }
+    return op;
+}
+
+void Chip8::written(uint16_t addr, uint16_t len)
+{
+    if (len == 0)
+    {
+        return;
+    }
+    const uint32_t last = ((uint32_t)addr + len - 1) / PageSize;
+    for (uint32_t p = addr / PageSize; p <= last; p++)
+    {
+        const uint32_t page = p % PageCount;
+        dirtyPages[page / 64] |= 1ULL << (page % 64);
+    }
+    invalidateCode(addr, len);
+}
+
+template<size_t Size>
+void Chip8::writeMemory(uint16_t addr, const uint8_t* data, uint16_t len)
+{
+    addr &= Size - 1;
+    if (addr + len <= Size)
+    {
+        std::memcpy(&memory[addr], data, len);
+        written(addr, len);
+        return;
+    }
+    // Runs off the end, the rest goes to the start
+    const uint16_t first = Size - addr;
+    std::memcpy(&memory[addr], data, first);
+    written(addr, first);
+    writeMemory<Size>(0, data + first, len - first);
+}
+
+template<size_t Size>
+void Chip8::readMemory(uint16_t addr, uint8_t* data, uint16_t len) const
+{
+    addr &= Size - 1;
+    if (addr + len <= Size)
+    {
+        std::memcpy(data, &memory[addr], len);
+        return;
+    }
+    const uint16_t first = Size - addr;
+    std::memcpy(data, &memory[addr], first);
+    readMemory<Size>(0, data + first, len - first);
+}
+
+template void Chip8::writeMemory<Chip8::MemorySize>(uint16_t, const uint8_t*, uint16_t);
+template void Chip8::writeMemory<Chip8::ClassicMemorySize>(uint16_t, const uint8_t*, uint16_t);
+template void Chip8::readMemory<Chip8::MemorySize>(uint16_t, uint8_t*, uint16_t) const;
+template void Chip8::readMemory<Chip8::ClassicMemorySize>(uint16_t, uint8_t*, uint16_t) const;
+
+void Chip8::invalidateCode(uint16_t addr, uint16_t len)
+{
+    // An instruction starting one byte earlier also covers addr
+    const uint16_t mask = memorySize() - 1;
+    for (uint32_t i = 0; i <= len; i++)
+    {
+        decoded[(addr - 1 + i) & mask].handler = OpNotDecoded;
+    }
+    if (jit)
+    {
+        jit->invalidate(addr, len);
+    }
+    if (aot)
+    {
+        aot->invalidate(addr, len);
+    }
+}
+
+uint64_t Chip8::step(uint64_t n)
+{
+    if (aot)
+    {
+        return aot->run(n);
+    }
+    // The JIT only knows the 4 KB machine
+    if (jit && !quirks().xoChip)
+    {
+        return jit->run(n);
+    }
+    return interpret(n);
+}
+
+uint64_t Chip8::interpret(uint64_t n)
+{
+    NoProfile none;
+    return execute(n, none);
+}
+
+uint64_t Chip8::profile(uint64_t n, Profile& p)
+{
+    return execute(n, p);
+}
+
+uint64_t Chip8::trace(uint64_t n, Tracer& t)
+{
+    return execute(n, t);
+}
+
+template<typename Profiler>
+uint64_t Chip8::execute(uint64_t n, Profiler& profiler)
+{
+    switch (quirkProfile)
+    {
+    case QuirksVip: return executeWith<quirkTable[QuirksVip]>(n, profiler);
+    case QuirksChip48: return executeWith<quirkTable[QuirksChip48]>(n, profiler);
+    case QuirksSchip: return executeWith<quirkTable[QuirksSchip]>(n, profiler);
+    case QuirksXoChip: return executeWith<quirkTable[QuirksXoChip]>(n, profiler);
+    default: return executeWith<quirkTable[QuirksModern]>(n, profiler);
+    }
+}
+
+template<Quirks Q, typename Profiler>
+uint64_t Chip8::executeWith(uint64_t n, Profiler& profiler)
+{
+    // Threaded dispatch: every handler jumps straight to the next one through
+    // this table instead of returning to a central switch. Must match Handler.
+    // The SUPER-CHIP and XO-CHIP instructions are undefined on machines
+    // without them, see handlerUnder().
+    static void* const dispatch[] = {
+        &&notDecoded, &&undefined, &&clear, &&ret, &&jump, &&call,
+        &&skipEqImm, &&skipNeqImm, &&skipEqReg, &&loadImm, &&addImm,
+        &&move, &&bitOr, &&bitAnd, &&bitXor, &&add, &&sub, &&shiftRight,
+        &&subReverse, &&shiftLeft, &&skipNeqReg, &&loadI, &&jumpOffset,
+        &&rand, &&draw, &&skipKey, &&skipNotKey, &&getDelay, &&waitForKey,
+        &&setDelay, &&setSound, &&addI, &&font, &&bcd, &&store, &&load,
+        Q.superChip ? &&exit : &&undefined, Q.superChip ? &&lowRes : &&undefined,
+        Q.superChip ? &&highRes : &&undefined, Q.superChip ? &&scrollDown : &&undefined,
+        Q.superChip ? &&scrollRight : &&undefined, Q.superChip ? &&scrollLeft : &&undefined,
+        Q.superChip ? &&drawLarge : &&drawEmpty, Q.superChip ? &&bigFont : &&undefined,
+        Q.superChip ? &&saveFlags : &&undefined, Q.superChip ? &&loadFlags : &&undefined,
+        Q.xoChip ? &&longI : &&undefined, Q.xoChip ? &&planes : &&undefined,
+        Q.xoChip ? &&audio : &&undefined, Q.xoChip ? &&pitch : &&undefined,
+        Q.xoChip ? &&saveRange : &&undefined, Q.xoChip ? &&loadRange : &&undefined,
+        Q.xoChip ? &&scrollUp : &&undefined
+    };
+    // Addresses wrap at the end of memory
+    constexpr size_t memorySize = Q.xoChip ? MemorySize : ClassicMemorySize;
+    constexpr uint16_t addressMask = memorySize - 1;
+    static_assert(sizeof(dispatch)/sizeof(dispatch[0]) == OpCount);
+
+    const uint64_t start = cycles;
+    const uint64_t end = cycles + n;
+    const DecodedOp* op;
+    uint8_t scratch;
+    #ifdef DEBUG
+    std::ostringstream s;
+    s.setf(s.hex, s.basefield);
+    #endif
+
+    // Finish the current instruction and dispatch the next one
+    // Tell the profiler about an instruction once it is known which one it is,
+    // and again when it is done
+    #define PROFILE() \
+        if constexpr (Profiler::enabled) { if (op->handler != OpNotDecoded) profiler.instruction(*this, *op); }
+    #define RETIRE() \
+        if constexpr (Profiler::enabled) { profiler.retire(*this); }
+    #ifdef DEBUG
+    #define TRACE_END() std::cout << s.str() << std::endl; RETIRE()
+    #define TRACE_BEGIN() s.str(""); std::cout << std::setfill('0') << std::setw(4) << std::hex << addrptr << ":" << std::setw(4) << (((uint16_t)memory[addrptr] << 8) | memory[addrptr+1]) << " ";
+    #else
+    #define TRACE_END() RETIRE()
+    #define TRACE_BEGIN()
+    #endif
+    #define DISPATCH() \
+        if (cycles == end || done) goto out; \
+        if (addrptr >= memorySize - 1) { stop(ExitPcOutOfRange); goto out; } \
+        op = &decoded[addrptr]; \
+        cycles++; \
+        PROFILE() \
+        TRACE_BEGIN() \
+        goto *dispatch[op->handler]
+    #define NEXT() TRACE_END() addrptr += 2; DISPATCH()
+    // Skip the next instruction, all four bytes of an XO-CHIP F000 nnnn
+    #define SKIP() \
+        addrptr += 2; \
+        if constexpr (Q.xoChip) { if (memory[addrptr] == 0xf0 && memory[(uint16_t)(addrptr + 1)] == 0x00) addrptr += 2; }
+    #define REGX regs[op->x]
+    #define REGY regs[op->y]
+
+    DISPATCH();
+
+notDecoded:
+    decoded[addrptr] = decode(((uint16_t)memory[addrptr] << 8) | memory[addrptr+1]);
+    PROFILE()
+    goto *dispatch[op->handler];
+
+undefined:
+    #ifdef DEBUG
+    s << "undefined instruction";
+    #endif
+    NEXT();
+
+// Clear the screen, the selected planes of it on XO-CHIP
+clear:
+    #ifdef DEBUG
+    s << "clear";
+    #endif
+    clearPlanes(planeMask);
+    NEXT();
+
+// Return
+ret:
+    if (sp == 0)
+    {
+        stop(ExitReturnEmptyStack);
+    }
+    else
+    {
+        addrptr = stack[--sp];
+    }
+    #ifdef DEBUG
+    s << "return to 0x" << addrptr;
+    #endif
+    NEXT();
+
+// Jump
+jump:
+    addrptr = op->nnn;
+    #ifdef DEBUG
+    s << "jump to 0x" << op->nnn;
+    #endif
+    TRACE_END()
+    DISPATCH();
+
+// Call
+call:
+    // Stack overflow stops the machine
+    if (sp == StackDepth)
+    {
+        stop(ExitStackOverflow);
+        NEXT();
+    }
+    stack[sp++] = addrptr;
+    addrptr = op->nnn;
+    #ifdef DEBUG
+    s << "call to 0x" << op->nnn;
+    #endif
+    TRACE_END()
+    DISPATCH();
+
+// Skip if unary eq
+skipEqImm:
+    #ifdef DEBUG
+    s << "if r" << (unsigned int)op->x << "(0x" << (unsigned int)REGX
+        << ") == 0x" << (unsigned int)op->nn << " then skip";
+    #endif
+    if (REGX == op->nn)
+    {
+        SKIP();
+    }
+    NEXT();
+
+// Skip if unary neq
+skipNeqImm:
+    #ifdef DEBUG
+    s << "if r" << (unsigned int)op->x << "(0x" << (unsigned int)REGX
+        << ") != 0x" << (unsigned int)op->nn << " then skip";
+    #endif
+    if (REGX != op->nn)
+    {
+        SKIP();
+    }
+    NEXT();
+
+// Skip if binary eq
+skipEqReg:
+    #ifdef DEBUG
+    s << "if r" << (unsigned int)op->x << "(0x" << (unsigned int)REGX << ") == r"
+        << (unsigned int)op->y << "(0x" << (unsigned int)REGY << ") then skip";
+    #endif
+    if (REGX == REGY)
+    {
+        SKIP();
+    }
+    NEXT();
+
+// Unary Assignment
+loadImm:
+    REGX = op->nn;
+    #ifdef DEBUG
+    s << "assign r" << (unsigned int)op->x << " the value 0x" << (unsigned int)op->nn;
+    #endif
+    NEXT();
+
+// Increment (don't change carry flag)
+addImm:
+    #ifdef DEBUG
+    s << "increment r" << (unsigned int)op->x << "(" << (unsigned int)REGX << ") by ";
+    #endif
+    REGX += op->nn;
+    #ifdef DEBUG
+    s << (unsigned int)op->nn << " = " << (unsigned int)REGX;
+    #endif
+    NEXT();
+
+// Binary assignment
+move:
+    #ifdef DEBUG
+    s << "r" << (unsigned int)op->x << "(" << (unsigned int)REGX << ") = r" << (unsigned int)op->y << "(" << (unsigned int)REGY << ")";
+    #endif
+    REGX = REGY;
+    NEXT();
+
+// Binary or
+bitOr:
+    #ifdef DEBUG
+    s << "r" << (unsigned int)op->x << "(" << (unsigned int)REGX << ") |= r" << (unsigned int)op->y << "(" << (unsigned int)REGY << ")";
+    #endif
+    REGX |= REGY;
+    if constexpr (Q.vfReset)
+    {
+        regs[0xf] = 0;
+    }
+    NEXT();
+
+// Binary and
+bitAnd:
+    #ifdef DEBUG
+    s << "r" << (unsigned int)op->x << "(" << (unsigned int)REGX << ") &= r" << (unsigned int)op->y << "(" << (unsigned int)REGY << ")";
+    #endif
+    REGX &= REGY;
+    if constexpr (Q.vfReset)
+    {
+        regs[0xf] = 0;
+    }
+    NEXT();
+
+// Binary xor
+bitXor:
+    #ifdef DEBUG
+    s << "r" << (unsigned int)op->x << "(" << (unsigned int)REGX << ") ^= r" << (unsigned int)op->y << "(" << (unsigned int)REGY << ")";
+    #endif
+    REGX ^= REGY;
+    if constexpr (Q.vfReset)
+    {
+        regs[0xf] = 0;
+    }
+    NEXT();
+
+// Binary increment
+add:
+    // x+y > 255 => carry happened
+    scratch = (REGX + REGY) > 0xff;
+    #ifdef DEBUG
+    s << "r" << (unsigned int)op->x << "(" << (unsigned int)REGX << ") += r" << (unsigned int)op->y << "(" << (unsigned int)REGY << ")";
+    s << " carry: rf=" << (unsigned int)scratch;
+    #endif
+    REGX += REGY;
+    regs[0xf] = scratch;
+    NEXT();
+
+// Binary decrement
+sub:
+    // result would be negative => borrow happened
+    scratch = REGX >= REGY;
+    #ifdef DEBUG
+    s << "r" << (unsigned int)op->x << "(" << (unsigned int)REGX << ") -= r" << (unsigned int)op->y << "(" << (unsigned int)REGY << ")";
+    s << " borrow: rf=" << (unsigned int)scratch;
+    #endif
+    REGX -= REGY;
+    regs[0xf] = scratch;
+    NEXT();
+
+// Binary shift right
+shiftRight:
+    {
+        const uint8_t source = Q.shiftVx ? REGX : REGY;
+        scratch = source & 0x01;
+        REGX = source >> 1;
+    }
+    regs[0xf] = scratch;
+    #ifdef DEBUG
+    s << "r" << (unsigned int)op->x << "(" << (unsigned int)REGX << ") = r" << (unsigned int)op->y << "(" << (unsigned int)REGY << ") >> 1";
+    #endif
+    NEXT();
+
+// Binary sub&store
+subReverse:
+    // result would be negative => borrow happened
+    scratch = REGY >= REGX;
+    #ifdef DEBUG
+    s << "r" << (unsigned int)op->x << " = r" << (unsigned int)op->y << "(" << (unsigned int)REGY << ") - r" << (unsigned int)op->x << "(" << (unsigned int)REGX << ")";
+    s << " borrow: rf=" << (unsigned int)scratch;
+    #endif
+    REGX = REGY - REGX;
+    regs[0xf] = scratch;
+    NEXT();
+
+// Binary shift left
+shiftLeft:
+    {
+        const uint8_t source = Q.shiftVx ? REGX : REGY;
+        scratch = source >> 7;
+        REGX = source << 1;
+    }
+    regs[0xf] = scratch;
+    #ifdef DEBUG
+    s << "r" << (unsigned int)op->x << "(" << (unsigned int)REGX << ") = r" << (unsigned int)op->y << "(" << (unsigned int)REGY << ") << 1";
+    #endif
+    NEXT();
+
+// Skip if binary neq
+skipNeqReg:
+    #ifdef DEBUG
+    s << "if r" << (unsigned int)op->x << "(0x" << (unsigned int)REGX << ") != r"
+        << (unsigned int)op->y << "(0x" << (unsigned int)REGY << ") then skip";
+    #endif
+    if (REGX != REGY)
+    {
+        SKIP();
+    }
+    NEXT();
+
+// Set memptr
+loadI:
+    memptr = op->nnn;
+    #ifdef DEBUG
+    s << "set memptr to 0x" << memptr;
+    #endif
+    NEXT();
+
+// Jump offset
+jumpOffset:
+    addrptr = (op->nnn + regs[Q.jumpVx ? op->x : 0]) & addressMask; // wraps like the address bus
+    #ifdef DEBUG
+    s << "jump to 0x" << op->nnn << " + " << (unsigned int)regs[Q.jumpVx ? op->x : 0];
+    s << " = 0x" << addrptr;
+    #endif
+    TRACE_END()
+    DISPATCH();
+
+// Random & mask
+rand:
+    scratch = random();
+    profiler.random(scratch);
+    REGX = scratch & op->nn;
+    #ifdef DEBUG
+    s << "r" << (unsigned int)op->x << " = random(" << (unsigned int)scratch << ") & mask(" << (unsigned int)op->nn << ")";
+    #endif
+    NEXT();
+
+// Draw sprite, if flipped from set to unset then vf=1 (carry flag)
+draw:
+    profiler.drawBegin();
+    regs[0xf] = drawFromMemory<Q.clip, memorySize>(REGX, REGY, memptr, op->n);
+    profiler.drawEnd();
+    #ifdef DEBUG
+    s << "draw 8x" << (unsigned int)op->n << " sprite at r" << (unsigned int)op->x << "(" << (unsigned int)REGX;
+    s << "),r" << (unsigned int)op->y << "(" << (unsigned int)REGY << ") I=";
+    s << memptr << " - collision:" << (unsigned int)regs[0xf];
+    #endif
+    NEXT();
+
+// Skip if key vx pressed
+skipKey:
+    #ifdef DEBUG
+    s << "if key r" << (unsigned int)op->x << "(" << (unsigned int)REGX << ")  is held then skip";
+    #endif
+    if (keyDown(REGX))
+    {
+        SKIP();
+    }
+    NEXT();
+
+// Skip if key vx not pressed
+skipNotKey:
+    #ifdef DEBUG
+    s << "if key r" << (unsigned int)op->x << "(" << (unsigned int)REGX << ") is not held then skip";
+    #endif
+    if (!keyDown(REGX))
+    {
+        SKIP();
+    }
+    NEXT();
+
+// Set vx to the value of the delay timer
+getDelay:
+    REGX = delay;
+    profiler.delayRead(delay);
+    #ifdef DEBUG
+    s << "Set r" << (unsigned int)op->x << " to delay(" << (unsigned int)delay << ")";
+    #endif
+    NEXT();
+
+// Wait for keypress and store in vx
+waitForKey:
+    #ifdef DEBUG
+    s << "wait for keypress/";
+    #endif
+    {
+        // Only a key pressed after the wait started counts, one still held
+        // from before, e.g. from the previous Fx0A, has to be let go first
+        if (!waitingForKey)
+        {
+            lastKeys = keys;
+            waitingForKey = true;
+        }
+        // Key changed from not pressed to pressed
+        uint16_t pressed = keys & ~lastKeys;
+        lastKeys = keys;
+        if (pressed == 0)
+        {
+            // Keys only change between runs, so nothing can happen until the
+            // next one. Wait out the rest of this run in one step; the machine
+            // ends up the same as if it had run this instruction over and over.
+            profiler.stall(*this, end - cycles);
+            TRACE_END()
+            cycles = end;
+            goto out;
+        }
+        waitingForKey = false;
+        REGX = __builtin_ctz(pressed);
+    }
+    #ifdef DEBUG
+    s << "key " << (unsigned int)REGX << " was pressed, store in r" << (unsigned int)op->x;
+    #endif
+    NEXT();
+
+// Set delay timer to the value of vx
+setDelay:
+    delay = REGX;
+    #ifdef DEBUG
+    s << "Set delay to r" << (unsigned int)op->x << "(" << (unsigned int)REGX << ")";
+    #endif
+    NEXT();
+
+// Set sound timer to the value of vx
+setSound:
+    sound = REGX;
+    #ifdef DEBUG
+    s << "Set sound to r" << (unsigned int)op->x << "(" << (unsigned int)REGX << ")";
+    #endif
+    NEXT();
+
+// Add vx to I
+addI:
+    #ifdef DEBUG
+    s << "Increment I(" << memptr << ") by r" << (unsigned int)op->x;
+    s << "(" << (unsigned int)REGX << ") = " << memptr+REGX;
+    #endif
+    memptr += REGX;
+    NEXT();
+
+// Set I to the location of the hex character stored in vx
+font:
+    memptr = (REGX & 0xf) * 5;
+    #ifdef DEBUG
+    s << "Set memptr to char r" << (unsigned int)op->x << "(" << (unsigned int)op->x << ")";
+    #endif
+    NEXT();
+
+// Store binary-coded decimal equivalent at I, I+1, I+2
+bcd:
+    {
+        const uint8_t digits[3] = {(uint8_t)(REGX/100), (uint8_t)((REGX%100)/10), (uint8_t)(REGX%10)};
+        writeMemory<memorySize>(memptr, digits, 3);
+    }
+    #ifdef DEBUG
+    s << "Store BCD of r" << (unsigned int)op->x << " starting at " << memptr
+        << " (" << (unsigned int)memory[memptr & addressMask] << "," << (unsigned int)memory[(memptr+1) & addressMask]
+        << "," << (unsigned int)memory[(memptr+2) & addressMask] << ")";
+    #endif
+    NEXT();
+
+// Store registers v0 to vX (inclusive) in memory starting at memptr, then move
+// memptr as the quirks say
+// NOTE: allows self-modifying code, so the decoded instructions are invalidated
+store:
+    writeMemory<memorySize>(memptr, regs.data(), op->x + 1);
+    #ifdef DEBUG
+    s << "Store r0 to r" << (unsigned int)op->x << " starting at " << memptr;
+    #endif
+    if constexpr (Q.index != Quirks::IndexKept)
+    {
+        memptr += op->x + (Q.index == Quirks::IndexAfter);
+    }
+    NEXT();
+
+// Fill registers v0 to vX (inclusive) from memory starting at memptr, then move
+// memptr as the quirks say
+load:
+    readMemory<memorySize>(memptr, regs.data(), op->x + 1);
+    #ifdef DEBUG
+    s << "Load r0 to r" << (unsigned int)op->x << " starting at " << memptr;
+    #endif
+    if constexpr (Q.index != Quirks::IndexKept)
+    {
+        memptr += op->x + (Q.index == Quirks::IndexAfter);
+    }
+    NEXT();
+
+// Exit the interpreter
+exit:
+    stop(ExitProgram);
+    #ifdef DEBUG
+    s << "exit";
+    #endif
+    NEXT();
+
+// Switch to 64x32
+lowRes:
+    setHires(false);
+    #ifdef DEBUG
+    s << "low resolution";
+    #endif
+    NEXT();
+
+// Switch to 128x64
+highRes:
+    setHires(true);
+    #ifdef DEBUG
+    s << "high resolution";
+    #endif
+    NEXT();
+
+// Scroll down n pixels
+scrollDown:
+    scrollDown(op->n);
+    #ifdef DEBUG
+    s << "scroll down " << (unsigned int)op->n;
+    #endif
+    NEXT();
+
+// Scroll right 4 pixels
+scrollRight:
+    scrollRight();
+    #ifdef DEBUG
+    s << "scroll right";
+    #endif
+    NEXT();
+
+// Scroll left 4 pixels
+scrollLeft:
+    scrollLeft();
+    #ifdef DEBUG
+    s << "scroll left";
+    #endif
+    NEXT();
+
+// Draw a 16x16 sprite of 2 bytes per row, vf=1 on collision
+drawLarge:
+    profiler.drawBegin();
+    regs[0xf] = drawFromMemory<Q.clip, memorySize>(REGX, REGY, memptr, 0);
+    profiler.drawEnd();
+    #ifdef DEBUG
+    s << "draw 16x16 sprite at r" << (unsigned int)op->x << "(" << (unsigned int)REGX;
+    s << "),r" << (unsigned int)op->y << "(" << (unsigned int)REGY << ") I=";
+    s << memptr << " - collision:" << (unsigned int)regs[0xf];
+    #endif
+    NEXT();
+
+// Dxy0 without SUPER-CHIP, a sprite of no rows that never collides
+drawEmpty:
+    profiler.drawBegin();
+    regs[0xf] = 0;
+    profiler.drawEnd();
+    #ifdef DEBUG
+    s << "draw 8x0 sprite at r" << (unsigned int)op->x << "(" << (unsigned int)REGX;
+    s << "),r" << (unsigned int)op->y << "(" << (unsigned int)REGY << ") I=";
+    s << memptr << " - collision:" << (unsigned int)regs[0xf];
+    #endif
+    NEXT();
+
+// Set I to the location of the large hex character stored in vx
+bigFont:
+    memptr = BigFontStart + (REGX & 0xf) * 10;
+    #ifdef DEBUG
+    s << "Set memptr to big char r" << (unsigned int)op->x << "(" << (unsigned int)REGX << ")";
+    #endif
+    NEXT();
+
+// Save registers v0 to vX (inclusive) in the user flags
+saveFlags:
+    std::copy(regs.begin(), regs.begin() + op->x + 1, userFlags.begin());
+    #ifdef DEBUG
+    s << "Save r0 to r" << (unsigned int)op->x << " in flags";
+    #endif
+    NEXT();
+
+// Fill registers v0 to vX (inclusive) from the user flags
+loadFlags:
+    std::copy(userFlags.begin(), userFlags.begin() + op->x + 1, regs.begin());
+    #ifdef DEBUG
+    s << "Load r0 to r" << (unsigned int)op->x << " from flags";
+    #endif
+    NEXT();
+
+// Set memptr to the 16 bit address in the next two bytes
+longI:
+    memptr = ((uint16_t)memory[(uint16_t)(addrptr + 2)] << 8) | memory[(uint16_t)(addrptr + 3)];
+    addrptr += 2;
+    #ifdef DEBUG
+    s << "set memptr to 0x" << memptr;
+    #endif
+    NEXT();
+
+// Select the planes drawn on, cleared and scrolled
+planes:
+    planeMask = op->x & ((1 << Planes) - 1);
+    #ifdef DEBUG
+    s << "select planes " << (unsigned int)planeMask;
+    #endif
+    NEXT();
+
+// Load the 16 byte audio pattern at memptr
+audio:
+    readMemory<memorySize>(memptr, audioPattern.data(), 16);
+    patternLoaded = true;
+    #ifdef DEBUG
+    s << "load audio pattern at " << memptr;
+    #endif
+    NEXT();
+
+// Set the playback pitch of the audio pattern to vx
+pitch:
+    pitch = REGX;
+    #ifdef DEBUG
+    s << "set pitch to r" << (unsigned int)op->x << "(" << (unsigned int)REGX << ")";
+    #endif
+    NEXT();
+
+// Store registers vx to vy (inclusive, either way round) in memory starting
+// at memptr, memptr does not move
+saveRange:
+    {
+        const int count = std::abs(op->x - op->y) + 1;
+        const int dir = op->x <= op->y ? 1 : -1;
+        uint8_t bytes[16];
+        for (int i = 0; i < count; i++)
+        {
+            bytes[i] = regs[op->x + i * dir];
+        }
+        writeMemory<memorySize>(memptr, bytes, count);
+    }
+    #ifdef DEBUG
+    s << "Store r" << (unsigned int)op->x << " to r" << (unsigned int)op->y << " starting at " << memptr;
+    #endif
+    NEXT();
+
+// Fill registers vx to vy (inclusive, either way round) from memory starting
+// at memptr, memptr does not move
+loadRange:
+    {
+        const int count = std::abs(op->x - op->y) + 1;
+        const int dir = op->x <= op->y ? 1 : -1;
+        uint8_t bytes[16];
+        readMemory<memorySize>(memptr, bytes, count);
+        for (int i = 0; i < count; i++)
+        {
+            regs[op->x + i * dir] = bytes[i];
+        }
+    }
+    #ifdef DEBUG
+    s << "Load r" << (unsigned int)op->x << " to r" << (unsigned int)op->y << " starting at " << memptr;
+    #endif
+    NEXT();
+
+// Scroll up n pixels
+scrollUp:
+    scrollUp(op->n);
+    #ifdef DEBUG
+    s << "scroll up " << (unsigned int)op->n;
+    #endif
+    NEXT();
+
+out:
+    #undef REGX
+    #undef REGY
+    #undef NEXT
+    #undef SKIP
+    #undef DISPATCH
+    #undef PROFILE
+    #undef RETIRE
+    #undef TRACE_BEGIN
+    #undef TRACE_END
+    return cycles - start;
+}
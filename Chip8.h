@@ -0,0 +1,309 @@
+#pragma once
+
+#include <array>
+#include <bit>
+#include <cstdint>
+#include <cstddef>
+#include <string>
+
+class Aot;
+struct AotProgram;
+class Jit;
+struct Profile;
+class Tracer;
+
+// Behaviours that differ between CHIP-8 implementations. A set of quirks is a
+// template parameter of the interpreter loop, so each profile gets its own
+// specialised loop with no run time checks.
+struct Quirks
+{
+    // Where Fx55/Fx65 leave I: after the last register, on it, or unchanged
+    enum IndexMode : uint8_t { IndexAfter, IndexLast, IndexKept };
+
+    // 8xy6/8xyE shift Vx in place instead of putting Vy shifted into Vx
+    bool shiftVx;
+    IndexMode index;
+    // Bnnn jumps to nnn + Vx, x being the top digit of nnn, instead of + V0
+    bool jumpVx;
+    // Dxyn wraps only the start position, sprites are cut off at the edges
+    bool clip;
+    // 8xy1/8xy2/8xy3 set VF to 0
+    bool vfReset;
+    // SUPER-CHIP: the 00Cn/00FB-00FF/Dxy0/Fx30/Fx75/Fx85 instructions.
+    // Without it those are undefined, except that Dxy0 draws a sprite of no
+    // rows as any other Dxyn would.
+    bool superChip;
+    // XO-CHIP: 64 KB of memory, the F000 nnnn/Fn01/F002/Fx3A/5xy2/5xy3/00Dn
+    // instructions, and skips step over the whole of an F000 nnnn. Without
+    // it those are undefined and addresses wrap at 4 KB.
+    bool xoChip;
+};
+
+// Headless CHIP-8 machine with the SUPER-CHIP and XO-CHIP extensions. Holds the complete
+// interpreter state and has no FLTK dependency; frontends feed it keys, read
+// back the pixels and decide how often to call step(). Optionally runs
+// through the x86-64 JIT.
+struct alignas(64) Chip8
+{
+    // The frame buffer, big enough for the SUPER-CHIP high resolution mode
+    static constexpr int ScreenWidth = 128;
+    static constexpr int ScreenHeight = 64;
+    // The original low resolution mode uses the top left corner of it
+    static constexpr int LowResWidth = 64;
+    static constexpr int LowResHeight = 32;
+    // One screen row, bit 127 is the leftmost pixel
+    typedef unsigned __int128 Row;
+    // XO-CHIP bitplanes, plane 0 is the only one classic programs draw on
+    static constexpr int Planes = 2;
+    // Every plane, screen[plane][row]
+    typedef std::array<std::array<Row, ScreenHeight>, Planes> Screen;
+    // XO-CHIP address space; everything else only sees the first 4 KB
+    static constexpr size_t MemorySize = 0x10000;
+    static constexpr size_t ClassicMemorySize = 0x1000;
+    // Writes are tracked in pages of this many bytes
+    static constexpr size_t PageSize = 64;
+    static constexpr size_t PageCount = MemorySize / PageSize;
+    // One bit per page of memory
+    typedef std::array<uint64_t, PageCount / 64> PageSet;
+    static constexpr uint16_t ProgramStart = 0x200;
+    static constexpr int StackDepth = 16;
+    // Hex digit sprites, 5 bytes each, loaded at address 0
+    static const uint8_t font[80];
+    // Large hex digit sprites for Fx30, 10 bytes each, loaded after `font`
+    static constexpr uint16_t BigFontStart = 80;
+    static const uint8_t bigFont[160];
+
+    // Frontend hook called at every 60 Hz tick before the sound timer counts
+    // down, e.g. Audio::onTick
+    typedef void (*TickHook)(void* ctx, const Chip8& m);
+
+    // Named sets of quirks, see quirkTable
+    enum QuirkProfile : uint8_t
+    {
+        QuirksModern, QuirksVip, QuirksChip48, QuirksSchip, QuirksXoChip, QuirkProfileCount
+    };
+    static constexpr Quirks quirkTable[QuirkProfileCount] = {
+        // What most current interpreters and test ROMs expect, the default
+        {.shiftVx = false, .index = Quirks::IndexAfter, .jumpVx = false, .clip = false, .vfReset = false, .superChip = false, .xoChip = false},
+        // The original COSMAC VIP interpreter
+        {.shiftVx = false, .index = Quirks::IndexAfter, .jumpVx = false, .clip = true, .vfReset = true, .superChip = false, .xoChip = false},
+        // CHIP-48 on the HP-48
+        {.shiftVx = true, .index = Quirks::IndexLast, .jumpVx = true, .clip = true, .vfReset = false, .superChip = false, .xoChip = false},
+        // SUPER-CHIP 1.1
+        {.shiftVx = true, .index = Quirks::IndexKept, .jumpVx = true, .clip = true, .vfReset = false, .superChip = true, .xoChip = false},
+        // XO-CHIP as Octo runs it
+        {.shiftVx = false, .index = Quirks::IndexAfter, .jumpVx = false, .clip = false, .vfReset = false, .superChip = true, .xoChip = true},
+    };
+
+    // Why `done` was set
+    enum ExitReason : uint8_t
+    {
+        ExitRunning, ExitReturnEmptyStack, ExitStackOverflow, ExitPcOutOfRange, ExitQuit,
+        // 00FD
+        ExitProgram
+    };
+
+    // Instruction handlers, in the order of the dispatch table in step()
+    enum Handler : uint8_t
+    {
+        OpNotDecoded, OpUndefined, OpClear, OpReturn, OpJump, OpCall,
+        OpSkipEqImm, OpSkipNeqImm, OpSkipEqReg, OpLoadImm, OpAddImm,
+        OpMove, OpOr, OpAnd, OpXor, OpAdd, OpSub, OpShiftRight,
+        OpSubReverse, OpShiftLeft, OpSkipNeqReg, OpLoadI, OpJumpOffset,
+        OpRandom, OpDraw, OpSkipKey, OpSkipNotKey, OpGetDelay, OpWaitKey,
+        OpSetDelay, OpSetSound, OpAddI, OpFont, OpBcd, OpStore, OpLoad,
+        // SUPER-CHIP, undefined unless the quirks say otherwise
+        OpExit, OpLowRes, OpHighRes, OpScrollDown, OpScrollRight, OpScrollLeft,
+        OpDrawLarge, OpBigFont, OpSaveFlags, OpLoadFlags,
+        // XO-CHIP, undefined unless the quirks say otherwise
+        OpLongI, OpPlanes, OpAudio, OpPitch, OpSaveRange, OpLoadRange, OpScrollUp,
+        OpCount
+    };
+
+    // An instruction with its operands already unpacked
+    struct DecodedOp
+    {
+        uint8_t handler;
+        uint8_t x, y, n;
+        uint8_t nn;
+        uint16_t nnn;
+    };
+    static_assert(sizeof(DecodedOp) == 8);
+
+    // Hot state first: registers, pointers, timers and input share a cache line
+    std::array<uint8_t, 16> regs;
+    uint16_t addrptr;
+    uint16_t memptr;
+    uint8_t delay;
+    uint8_t sound;
+    uint8_t sp;
+    bool done;
+    // 128x64 instead of 64x32, switched by 00FF and 00FE
+    bool hires;
+    // Bit n set when plane n is drawn on, cleared and scrolled, set by Fn01
+    uint8_t planeMask;
+    uint8_t exitReason;
+    // Set while an Fx0A waits for a key
+    bool waitingForKey;
+    // Bit n is set while key n is held down
+    uint16_t keys;
+    // The keys as Fx0A last saw them
+    uint16_t lastKeys;
+    uint32_t rngState;
+    // Bit n is set when row n of the screen changed, cleared by the frontend
+    uint64_t dirtyRows;
+    uint64_t cycles;
+    TickHook tickHook;
+    void* tickCtx;
+    // Length of a 60 Hz timer tick on the virtual clock used by advance(),
+    // in instructions
+    uint64_t instructionsPerTick;
+    // Change with setQuirks(), kept by reset()
+    QuirkProfile quirkProfile;
+    // Memory and decode cache of the current profile, memorySize() entries:
+    // classicMemory and classicDecoded, or for XO-CHIP 64 KB of each that
+    // setQuirks() allocates and the machine owns
+    uint8_t* memory;
+    DecodedOp* decoded;
+
+    std::array<uint16_t, StackDepth> stack;
+    // The 4 KB the classic profiles see, inline so that resetting or copying
+    // a machine does not touch 64 KB it never addresses
+    std::array<uint8_t, ClassicMemorySize> classicMemory;
+    // Bit n is set when page n of memory was written, all of them after
+    // reset(). Cleared by Rewind, which only looks at these pages.
+    PageSet dirtyPages;
+    Screen pixels;
+    // Written by Fx75 and read back by Fx85, the HP-48 RPL user flags
+    std::array<uint8_t, 16> userFlags;
+    // XO-CHIP sound: 128 one bit samples loaded by F002 and played while the
+    // sound timer runs, at 4000 * 2^((pitch - 64) / 48) samples a second.
+    // Until F002 runs the buzzer is the usual tone.
+    std::array<uint8_t, 16> audioPattern;
+    uint8_t pitch;
+    bool patternLoaded;
+    // Decode cache indexed by address, filled lazily by interpret()
+    std::array<DecodedOp, ClassicMemorySize> classicDecoded;
+    // Owned, null unless enableJit() succeeded
+    Jit* jit;
+    // Owned, null unless enableAot() was called
+    Aot* aot;
+
+    Chip8();
+    ~Chip8();
+    Chip8(const Chip8&) = delete;
+    Chip8& operator=(const Chip8&) = delete;
+
+    // Reset registers, memory and screen and load the font
+    void reset();
+    void seed(uint32_t s);
+    // Copy a ROM image to 0x200. Returns false if it does not fit in the
+    // memory of the current quirk profile, so set the quirks first
+    bool load(const uint8_t* data, size_t size);
+    bool loadFile(const std::string& filename);
+
+    // Execute up to n instructions, returns the number actually executed
+    uint64_t step(uint64_t n = 1);
+    // Same as step() but always through the decode cache interpreter
+    uint64_t interpret(uint64_t n);
+    // Same as interpret() while counting into p, see Profile.h
+    uint64_t profile(uint64_t n, Profile& p);
+    // Same as interpret() while recording every instruction, see Trace.h
+    uint64_t trace(uint64_t n, Tracer& t);
+    // Runs executeWith() for the current quirk profile
+    template<typename Profiler>
+    uint64_t execute(uint64_t n, Profiler& profiler);
+    // The interpreter loop with a set of quirks and the hooks of a profiling
+    // policy compiled in
+    template<Quirks Q, typename Profiler>
+    uint64_t executeWith(uint64_t n, Profiler& profiler);
+    // Translate hot code to native x86-64. Returns false where unsupported
+    bool enableJit();
+    // Run the blocks of a ROM translated by chip-aot wherever memory still
+    // holds that ROM, see Aot.h. Takes precedence over the JIT. Returns false
+    // for XO-CHIP programs, which it does not cover.
+    bool enableAot(const AotProgram& program);
+    // Execute until the cycle counter reaches `target` or the machine stops
+    uint64_t runUntil(uint64_t target);
+    // Execute one 60 Hz frame of n instructions, then tick the timers
+    uint64_t runFrame(uint64_t n);
+    // Execute n instructions, ticking the timers every time `cycles` reaches a
+    // multiple of instructionsPerTick. Timing only depends on the instruction
+    // count, so it is the same however the calls are split up, headless or
+    // faster than real time.
+    uint64_t advance(uint64_t n);
+    void stop(ExitReason r) { done = true; exitReason = r; }
+    static const char* exitName(ExitReason r);
+    // Switching between XO-CHIP and the other profiles moves the first 4 KB
+    // of memory over, drops the rest and the decoded code
+    void setQuirks(QuirkProfile p);
+    const Quirks& quirks() const { return quirkTable[quirkProfile]; }
+    size_t memorySize() const { return quirks().xoChip ? MemorySize : ClassicMemorySize; }
+    // What an instruction decoded as h runs as under q: SUPER-CHIP and
+    // XO-CHIP instructions the quirks leave out are undefined, and Dxy0
+    // without SUPER-CHIP is a Dxyn of no rows
+    static constexpr uint8_t handlerUnder(uint8_t h, const Quirks& q)
+    {
+        if (h >= OpLongI && !q.xoChip)
+        {
+            return OpUndefined;
+        }
+        if (h >= OpExit && h <= OpLoadFlags && !q.superChip)
+        {
+            return h == OpDrawLarge ? OpDraw : OpUndefined;
+        }
+        return h;
+    }
+    // Largest ROM load() takes: 4 KB machines only address 0x200-0xfff
+    static constexpr size_t maxRomSize(QuirkProfile p) { return (quirkTable[p].xoChip ? MemorySize : ClassicMemorySize) - ProgramStart; }
+    static const char* quirkName(QuirkProfile p);
+    // Accepts the names printed by quirkName(). Returns false if unknown
+    static bool parseQuirks(const std::string& name, QuirkProfile& p);
+    uint64_t screenHash() const;
+
+    // Must be called after writing to memory directly: marks the pages of
+    // [addr, addr+len) dirty and drops the decoded instructions there
+    void written(uint16_t addr, uint16_t len);
+    // Drop the decoded instructions covering [addr, addr+len) only
+    void invalidateCode(uint16_t addr, uint16_t len);
+    // Copy len bytes to or from memory at addr, wrapping at Size (MemorySize
+    // or ClassicMemorySize). Accesses that do not wrap, nearly all of them,
+    // are one memcpy; writes call written().
+    template<size_t Size>
+    void writeMemory(uint16_t addr, const uint8_t* data, uint16_t len);
+    template<size_t Size>
+    void readMemory(uint16_t addr, uint8_t* data, uint16_t len) const;
+    bool pageDirty(size_t page) const { return (dirtyPages[page / 64] >> (page % 64)) & 1; }
+    static DecodedOp decode(uint16_t inst);
+
+    // Decrement delay and sound, called at 60 Hz
+    void tick();
+
+    uint8_t random();
+    bool pixel(int x, int y, int plane = 0) const { return (pixels[plane][y] >> (ScreenWidth - 1 - x)) & 1; }
+    // Size of the screen in the current mode
+    int width() const { return hires ? ScreenWidth : LowResWidth; }
+    int height() const { return hires ? ScreenHeight : LowResHeight; }
+    // XOR a sprite onto one plane, wrapping at the edges or with Clip, cut
+    // off at them. Each row is aligned to the left edge of the screen like a
+    // row of pixels. Returns true if any pixel was switched off.
+    template<bool Clip = false>
+    bool drawSprite(uint8_t x, uint8_t y, const Row* rows, uint8_t height, int plane = 0);
+    // Dxyn, Dxy0 for n = 0, on the planes in planeMask: an 8xn sprite or a
+    // 16x16 one of 32 bytes from `source`, the next plane's following it and
+    // every byte wrapping at Size. Returns the new VF.
+    template<bool Clip, size_t Size>
+    bool drawFromMemory(uint8_t x, uint8_t y, uint16_t source, uint8_t n);
+    // Clear every plane
+    void clearScreen();
+    // Clear the planes set in `planes`
+    void clearPlanes(uint8_t planes);
+    // Switch resolution, which clears the screen
+    void setHires(bool on);
+    // Scroll the planes in planeMask n pixels down or up, or 4 pixels sideways
+    void scrollDown(uint8_t n);
+    void scrollUp(uint8_t n);
+    void scrollRight();
+    void scrollLeft();
+    bool keyDown(uint8_t key) const { return (keys >> (key & 0xf)) & 1; }
+};
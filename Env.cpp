@@ -0,0 +1,291 @@
+#include "Env.h"
+#include "Rom.h"
+
+#include <algorithm>
+#include <array>
+#include <cstring>
+
+namespace
+{
+    // Byte k of spread[b] is bit 7-k of b, so eight pixels of a row become
+    // eight bytes in screen order with one store (x86-64 is little-endian)
+    constexpr std::array<uint64_t, 256> makeSpread()
+    {
+        std::array<uint64_t, 256> table {};
+        for (int b = 0; b < 256; b++)
+        {
+            for (int k = 0; k < 8; k++)
+            {
+                table[b] |= (uint64_t)((b >> (7 - k)) & 1) << (8 * k);
+            }
+        }
+        return table;
+    }
+    constexpr std::array<uint64_t, 256> spread = makeSpread();
+
+    // Eight pixels starting at x of one row, both planes
+    uint64_t pixels8(const Chip8& m, int row, int x)
+    {
+        const int shift = Chip8::ScreenWidth - 8 - x;
+        return spread[(uint8_t)(m.pixels[0][row] >> shift)] | spread[(uint8_t)(m.pixels[1][row] >> shift)] << 1;
+    }
+
+    // Different for every environment and episode, and never zero
+    uint32_t episodeSeed(uint32_t seed, size_t env, uint32_t episode)
+    {
+        uint32_t h = seed ^ (uint32_t)env * 0x9e3779b9 ^ episode * 0x85ebca6b;
+        h ^= h >> 16;
+        h *= 0x7feb352d;
+        h ^= h >> 15;
+        h *= 0x846ca68b;
+        h ^= h >> 16;
+        return h ? h : 1;
+    }
+}
+
+Env::Env(size_t count, const EnvOptions& o) : options(o), frames(count), episodes(count), finished(count, 1),
+    job(Reset), which(nullptr), actions(nullptr), observations(nullptr), rewards(nullptr), dones(nullptr),
+    generation(0), pending(0)
+{
+    for (size_t i = 0; i < count; i++)
+    {
+        machines.emplace_back(new Chip8);
+        machines.back()->setQuirks(options.quirks);
+        machines.back()->instructionsPerTick = options.instructionsPerFrame;
+        if (options.jit)
+        {
+            machines.back()->enableJit();
+        }
+    }
+    options.frameSkip = std::max(1u, options.frameSkip);
+    threads = options.threads ? options.threads : std::thread::hardware_concurrency();
+    threads = std::max(1u, std::min<unsigned>(threads, count));
+    for (unsigned w = 1; w < threads; w++)
+    {
+        workers.emplace_back(&Env::work, this, w);
+    }
+}
+
+Env::~Env()
+{
+    job = Quit;
+    generation.fetch_add(1, std::memory_order_release);
+    generation.notify_all();
+    for (auto &&t : workers)
+    {
+        t.join();
+    }
+}
+
+bool Env::load(const std::string& filename, std::string& error)
+{
+    RomFile rom;
+    return rom.open(filename, error) && load(rom.data(), rom.size(), error);
+}
+
+bool Env::load(const uint8_t* rom, size_t size, std::string& error)
+{
+    if (size > Chip8::maxRomSize(options.quirks))
+    {
+        error = std::string("The ROM does not fit in memory under ") + Chip8::quirkName(options.quirks);
+        return false;
+    }
+    // Analysed once, every reset starts from a copy with the code decoded.
+    // XO-CHIP programs too large for an image are loaded on every reset.
+    image.reset();
+    program.clear();
+    if (size <= RomImage::MaxRomSize)
+    {
+        image.reset(new RomImage);
+        image->build(rom, size);
+    }
+    else
+    {
+        program.assign(rom, rom + size);
+    }
+    std::fill(finished.begin(), finished.end(), 1);
+    return true;
+}
+
+void Env::reset(const uint8_t* w, uint8_t* obs)
+{
+    which = w;
+    observations = obs;
+    dispatch(Reset);
+}
+
+void Env::step(const uint16_t* a, uint8_t* obs, float* r, uint8_t* d)
+{
+    actions = a;
+    observations = obs;
+    rewards = r;
+    dones = d;
+    dispatch(Step);
+}
+
+void Env::range(unsigned w, size_t& first, size_t& end) const
+{
+    first = count() * w / threads;
+    end = count() * (w + 1) / threads;
+}
+
+void Env::dispatch(Job j)
+{
+    job = j;
+    pending.store(threads - 1, std::memory_order_relaxed);
+    generation.fetch_add(1, std::memory_order_release);
+    generation.notify_all();
+
+    size_t first, end;
+    range(0, first, end);
+    run(first, end);
+
+    unsigned left;
+    while ((left = pending.load(std::memory_order_acquire)) != 0)
+    {
+        pending.wait(left, std::memory_order_acquire);
+    }
+}
+
+void Env::work(unsigned w)
+{
+    size_t first, end;
+    range(w, first, end);
+    uint64_t seen = 0;
+    while (true)
+    {
+        generation.wait(seen, std::memory_order_acquire);
+        seen = generation.load(std::memory_order_acquire);
+        if (job == Quit)
+        {
+            return;
+        }
+        run(first, end);
+        if (pending.fetch_sub(1, std::memory_order_acq_rel) == 1)
+        {
+            pending.notify_one();
+        }
+    }
+}
+
+void Env::run(size_t first, size_t end)
+{
+    for (size_t env = first; env < end; env++)
+    {
+        if (job == Step)
+        {
+            stepOne(env);
+        }
+        else if (!which || which[env])
+        {
+            resetOne(env);
+        }
+    }
+}
+
+void Env::resetOne(size_t env)
+{
+    Chip8& m = *machines[env];
+    if (image)
+    {
+        image->apply(m);
+    }
+    else
+    {
+        m.reset();
+        m.load(program.data(), program.size());
+    }
+    m.seed(episodeSeed(options.seed, env, episodes[env]++));
+    frames[env] = 0;
+    finished[env] = !image && program.empty();
+    if (observations)
+    {
+        observe(m, observations + env * observationSize());
+    }
+}
+
+void Env::stepOne(size_t env)
+{
+    Chip8& m = *machines[env];
+    float total = 0;
+    if (!finished[env])
+    {
+        m.keys = actions ? actions[env] : 0;
+        for (unsigned f = 0; f < options.frameSkip && !finished[env]; f++)
+        {
+            m.runFrame(options.instructionsPerFrame);
+            frames[env]++;
+            bool done = m.done;
+            if (options.reward)
+            {
+                total += options.reward(options.rewardCtx, m, env, done);
+            }
+            finished[env] = done || (options.maxFrames && frames[env] >= options.maxFrames);
+        }
+    }
+    if (rewards)
+    {
+        rewards[env] = total;
+    }
+    if (dones)
+    {
+        dones[env] = finished[env];
+    }
+    if (observations)
+    {
+        observe(m, observations + env * observationSize());
+    }
+}
+
+void Env::observe(const Chip8& m, uint8_t* out) const
+{
+    if (options.hires == m.hires)
+    {
+        // One pixel per byte, eight at a time
+        for (int r = 0; r < height(); r++)
+        {
+            for (int x = 0; x < width(); x += 8)
+            {
+                const uint64_t eight = pixels8(m, r, x);
+                std::memcpy(out, &eight, 8);
+                out += 8;
+            }
+        }
+    }
+    else if (options.hires)
+    {
+        // Low resolution, every pixel twice in both directions
+        for (int r = 0; r < Chip8::LowResHeight; r++)
+        {
+            for (int x = 0; x < Chip8::LowResWidth; x += 8)
+            {
+                const uint64_t eight = pixels8(m, r, x);
+                for (int k = 0; k < 8; k++)
+                {
+                    out[2*k] = out[2*k + 1] = eight >> (8 * k);
+                }
+                out += 16;
+            }
+            std::memcpy(out, out - Chip8::ScreenWidth, Chip8::ScreenWidth);
+            out += Chip8::ScreenWidth;
+        }
+    }
+    else
+    {
+        // High resolution in a low resolution observation, every other
+        // pixel of every other row
+        for (int r = 0; r < Chip8::LowResHeight; r++)
+        {
+            for (int x = 0; x < Chip8::ScreenWidth; x += 16)
+            {
+                const uint64_t left = pixels8(m, 2*r, x), right = pixels8(m, 2*r, x + 8);
+                for (int k = 0; k < 4; k++)
+                {
+                    out[k] = left >> (16 * k);
+                    out[k + 4] = right >> (16 * k);
+                }
+                out += 8;
+            }
+        }
+    }
+}
@@ -0,0 +1,122 @@
+#pragma once
+
+#include <atomic>
+#include <cstdint>
+#include <cstddef>
+#include <memory>
+#include <string>
+#include <thread>
+#include <vector>
+
+#include "Chip8.h"
+
+struct RomImage;
+
+// Reward for one environment after each frame it runs. Called from the
+// worker threads, so it must be safe to call concurrently for different
+// environments. Setting `done` ends the episode.
+typedef float (*RewardHook)(void* ctx, const Chip8& m, size_t env, bool& done);
+
+struct EnvOptions
+{
+    // 0 means one worker per host core, never more than environments
+    unsigned threads = 0;
+    uint64_t instructionsPerFrame = 11;
+    // Frames run per step with the same keys, their rewards add up
+    unsigned frameSkip = 4;
+    // Episodes end after this many frames, 0 for no limit
+    uint64_t maxFrames = 0;
+    Chip8::QuirkProfile quirks = Chip8::QuirksModern;
+    bool jit = false;
+    // Environment i of episode e is seeded from seed, i and e
+    uint32_t seed = 1;
+    // 128x64 observations for SUPER-CHIP and XO-CHIP games, see Env
+    bool hires = false;
+    RewardHook reward = nullptr;
+    void* rewardCtx = nullptr;
+};
+
+// N copies of one ROM stepped together, for training agents:
+//
+//   Env env(64, options);
+//   env.load("pong.ch8", error);
+//   std::vector<uint8_t> obs(env.count() * env.observationSize());
+//   std::vector<float> rewards(env.count());
+//   std::vector<uint8_t> dones(env.count());
+//   env.reset(nullptr, obs.data());
+//   env.step(actions, obs.data(), rewards.data(), dones.data());
+//
+// Actions are key masks like Chip8::keys, one per environment. Observations
+// are one byte per pixel, the XO-CHIP plane bits (0 or 1 for other programs),
+// row by row, written for every environment into the caller's buffer at
+// env * observationSize(). They are always 64x32, or with EnvOptions::hires
+// 128x64, whatever mode the program is in: low resolution frames are scaled
+// up, high resolution ones keep every other pixel in 64x32 observations.
+// Any of the output buffers may be null.
+//
+// The environments are split into one contiguous range per worker thread.
+// The threads live as long as the Env and wait on an atomic between steps,
+// so a step costs one wake-up per worker on top of the emulation.
+class Env
+{
+public:
+    Env(size_t count, const EnvOptions& options);
+    ~Env();
+    Env(const Env&) = delete;
+    Env& operator=(const Env&) = delete;
+
+    // The ROM every environment runs. Returns false and sets `error` if it
+    // can not be read; reset() must be called before stepping.
+    bool load(const std::string& filename, std::string& error);
+    bool load(const uint8_t* rom, size_t size, std::string& error);
+
+    size_t count() const { return machines.size(); }
+    int width() const { return options.hires ? Chip8::ScreenWidth : Chip8::LowResWidth; }
+    int height() const { return options.hires ? Chip8::ScreenHeight : Chip8::LowResHeight; }
+    size_t observationSize() const { return (size_t)width() * height(); }
+
+    // Start a new episode in the environments where which[i] is set, all of
+    // them for nullptr, and write their observations
+    void reset(const uint8_t* which, uint8_t* observations);
+    // Run frameSkip frames in every environment that is not done. Done
+    // environments stay done, with reward 0, until they are reset.
+    void step(const uint16_t* actions, uint8_t* observations, float* rewards, uint8_t* dones);
+
+    // The machine of one environment, e.g. to look at its memory between
+    // steps. Not while a step runs.
+    const Chip8& machine(size_t env) const { return *machines[env]; }
+
+private:
+    EnvOptions options;
+    std::unique_ptr<RomImage> image;
+    // The ROM instead of an image when it is too large for one
+    std::vector<uint8_t> program;
+    std::vector<std::unique_ptr<Chip8>> machines;
+    std::vector<uint64_t> frames;
+    std::vector<uint32_t> episodes;
+    std::vector<uint8_t> finished;
+
+    // What the workers do next, published with `generation`
+    enum Job { Reset, Step, Quit };
+    Job job;
+    const uint8_t* which;
+    const uint16_t* actions;
+    uint8_t* observations;
+    float* rewards;
+    uint8_t* dones;
+    // Workers plus the calling thread, fixed before the workers start
+    unsigned threads;
+    std::vector<std::thread> workers;
+    std::atomic<uint64_t> generation;
+    std::atomic<unsigned> pending;
+
+    // Run the current job on every worker and the calling thread
+    void dispatch(Job j);
+    void work(unsigned worker);
+    // Environments [first, end) of worker w, 0 being the calling thread
+    void range(unsigned w, size_t& first, size_t& end) const;
+    void run(size_t first, size_t end);
+    void resetOne(size_t env);
+    void stepOne(size_t env);
+    void observe(const Chip8& m, uint8_t* out) const;
+};
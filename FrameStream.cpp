@@ -0,0 +1,272 @@
+#include "FrameStream.h"
+
+#include <cerrno>
+#include <cstdio>
+#include <cstring>
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+namespace
+{
+    const char magic[4] = {'C', '8', 'F', 'S'};
+
+    // shm_open() wants one leading slash
+    std::string shmName(const std::string& name)
+    {
+        return name[0] == '/' ? name : "/" + name;
+    }
+}
+
+size_t packFrame(const Chip8& m, int plane, uint8_t* out)
+{
+    const int bytes = m.width() / 8;
+    for (int r = 0; r < m.height(); r++)
+    {
+        // The row is already in pixel order from the top bit down, so it
+        // only needs to be stored big-endian
+        const Chip8::Row row = m.pixels[plane][r];
+        const uint64_t high = __builtin_bswap64((uint64_t)(row >> 64));
+        const uint64_t low = __builtin_bswap64((uint64_t)row);
+        std::memcpy(out, &high, 8);
+        if (bytes > 8)
+        {
+            std::memcpy(out + 8, &low, 8);
+        }
+        out += bytes;
+    }
+    return bytes * m.height();
+}
+
+FrameRing::FrameRing() : header(nullptr), slots(nullptr), mappedSize(0)
+{
+}
+
+FrameRing::~FrameRing()
+{
+    if (header)
+    {
+        munmap(header, mappedSize);
+    }
+}
+
+bool FrameRing::create(const std::string& name, uint32_t count, std::string& error)
+{
+    if (name.empty() || count == 0)
+    {
+        error = "A frame ring needs a name and at least one slot";
+        return false;
+    }
+    const std::string path = shmName(name);
+    // A fresh object, so readers still mapping an old one are not cut short
+    shm_unlink(path.c_str());
+    int fd = shm_open(path.c_str(), O_RDWR | O_CREAT | O_EXCL, 0644);
+    if (fd < 0)
+    {
+        error = "Could not create shared memory " + path + ": " + std::strerror(errno);
+        return false;
+    }
+    const size_t size = sizeof(FrameRingHeader) + (size_t)count * sizeof(FrameSlot);
+    void* p = MAP_FAILED;
+    if (ftruncate(fd, size) == 0)
+    {
+        p = mmap(nullptr, size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+    }
+    ::close(fd);
+    if (p == MAP_FAILED)
+    {
+        error = "Could not map shared memory " + path + ": " + std::strerror(errno);
+        shm_unlink(path.c_str());
+        return false;
+    }
+    if (header)
+    {
+        munmap(header, mappedSize);
+    }
+    // New objects are zero filled, every slot starts out empty
+    header = static_cast<FrameRingHeader*>(p);
+    slots = reinterpret_cast<FrameSlot*>(header + 1);
+    mappedSize = size;
+    header->version = Version;
+    header->slots = count;
+    header->slotSize = sizeof(FrameSlot);
+    // Readers check the magic last
+    std::atomic_thread_fence(std::memory_order_release);
+    std::memcpy(header->magic, magic, sizeof(magic));
+    return true;
+}
+
+bool FrameRing::publish(const Chip8& m)
+{
+    if (!header)
+    {
+        return false;
+    }
+    const uint64_t n = header->sequence.load(std::memory_order_relaxed) + 1;
+    FrameSlot& slot = slots[n % header->slots];
+    slot.sequence.store(0, std::memory_order_relaxed);
+    std::atomic_thread_fence(std::memory_order_release);
+
+    slot.cycles = m.cycles;
+    slot.width = m.width();
+    slot.height = m.height();
+    slot.planes = 0;
+    for (int p = 0; p < Chip8::Planes; p++)
+    {
+        packFrame(m, p, slot.bits[p].data());
+        for (int r = 0; r < m.height(); r++)
+        {
+            if (m.pixels[p][r])
+            {
+                slot.planes |= 1 << p;
+                break;
+            }
+        }
+    }
+
+    slot.sequence.store(n, std::memory_order_release);
+    header->sequence.store(n, std::memory_order_release);
+    return true;
+}
+
+FrameRingReader::FrameRingReader() : header(nullptr), slots(nullptr), mappedSize(0)
+{
+}
+
+FrameRingReader::~FrameRingReader()
+{
+    if (header)
+    {
+        munmap(const_cast<FrameRingHeader*>(header), mappedSize);
+    }
+}
+
+bool FrameRingReader::open(const std::string& name, std::string& error)
+{
+    const std::string path = shmName(name);
+    int fd = shm_open(path.c_str(), O_RDONLY, 0);
+    if (fd < 0)
+    {
+        error = "Could not open shared memory " + path + ": " + std::strerror(errno);
+        return false;
+    }
+    struct stat st;
+    void* p = MAP_FAILED;
+    if (fstat(fd, &st) == 0 && (size_t)st.st_size >= sizeof(FrameRingHeader))
+    {
+        p = mmap(nullptr, st.st_size, PROT_READ, MAP_SHARED, fd, 0);
+    }
+    ::close(fd);
+    if (p == MAP_FAILED)
+    {
+        error = path + " is not a frame ring";
+        return false;
+    }
+    const FrameRingHeader* h = static_cast<const FrameRingHeader*>(p);
+    const bool ok = std::memcmp(h->magic, magic, sizeof(magic)) == 0;
+    std::atomic_thread_fence(std::memory_order_acquire);
+    if (!ok || h->version != FrameRing::Version || h->slotSize != sizeof(FrameSlot) || h->slots == 0
+        || (size_t)st.st_size < sizeof(FrameRingHeader) + (size_t)h->slots * sizeof(FrameSlot))
+    {
+        munmap(p, st.st_size);
+        error = path + " is not a frame ring of this version";
+        return false;
+    }
+    if (header)
+    {
+        munmap(const_cast<FrameRingHeader*>(header), mappedSize);
+    }
+    header = h;
+    slots = reinterpret_cast<const FrameSlot*>(header + 1);
+    mappedSize = st.st_size;
+    return true;
+}
+
+const FrameSlot& FrameRingReader::slot(uint64_t n) const
+{
+    return slots[n % header->slots];
+}
+
+bool FrameRingReader::valid(uint64_t n) const
+{
+    // Orders the reads of the frame before the second look at the sequence
+    std::atomic_thread_fence(std::memory_order_acquire);
+    return n != 0 && slot(n).sequence.load(std::memory_order_relaxed) == n;
+}
+
+FramePipe::FramePipe() : fd(-1), format(Raw), failed(false)
+{
+}
+
+FramePipe::~FramePipe()
+{
+    close();
+}
+
+bool FramePipe::open(const std::string& filename, Format f)
+{
+    close();
+    fd = filename == "-" ? dup(STDOUT_FILENO) : ::open(filename.c_str(), O_WRONLY | O_CREAT | O_TRUNC, 0644);
+    format = f;
+    failed = false;
+    return fd >= 0;
+}
+
+bool FramePipe::publish(const Chip8& m)
+{
+    if (fd < 0 || failed)
+    {
+        return false;
+    }
+    size_t size = 0;
+    if (format == Pbm)
+    {
+        size = std::snprintf((char*)buffer.data(), 32, "P4\n%d %d\n", m.width(), m.height());
+    }
+    const int bytes = m.width() * m.height() / 8;
+    packFrame(m, 0, &buffer[size]);
+    if (m.quirks().xoChip)
+    {
+        // Merge the other planes in, only XO-CHIP programs draw on them
+        uint8_t other[Chip8::ScreenWidth * Chip8::ScreenHeight / 8];
+        for (int p = 1; p < Chip8::Planes; p++)
+        {
+            packFrame(m, p, other);
+            for (int i = 0; i < bytes; i++)
+            {
+                buffer[size + i] |= other[i];
+            }
+        }
+    }
+    size += bytes;
+
+    // One write per frame, a pipe may take it in pieces
+    const uint8_t* p = buffer.data();
+    while (size > 0)
+    {
+        ssize_t n = ::write(fd, p, size);
+        if (n < 0 && errno == EINTR)
+        {
+            continue;
+        }
+        if (n <= 0)
+        {
+            failed = true;
+            return false;
+        }
+        p += n;
+        size -= n;
+    }
+    return true;
+}
+
+bool FramePipe::close()
+{
+    if (fd >= 0)
+    {
+        failed = ::close(fd) != 0 || failed;
+        fd = -1;
+    }
+    return !failed;
+}
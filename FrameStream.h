@@ -0,0 +1,139 @@
+#pragma once
+
+#include <atomic>
+#include <array>
+#include <cstdint>
+#include <cstddef>
+#include <string>
+
+#include "Chip8.h"
+
+// Getting every frame out of a headless run, for visual regression tests and
+// recording. Frames are packed the way PBM (P4) stores pixels: rows top to
+// bottom, width/8 bytes each, the leftmost pixel in the top bit.
+
+// Pack one plane of the screen in the current resolution into `out`, which
+// must hold width()*height()/8 bytes. Returns the number of bytes written.
+size_t packFrame(const Chip8& m, int plane, uint8_t* out);
+
+// Where frames go, once per 60 Hz frame
+class FrameSink
+{
+public:
+    virtual ~FrameSink() {}
+    // Returns false once the frame could not be delivered
+    virtual bool publish(const Chip8& m) = 0;
+};
+
+// Shared memory ring layout. The file starts with a FrameRingHeader and the
+// slots follow it, slotSize bytes apart. Frame n (counting from 1) goes in
+// slot n % slots.
+struct FrameRingHeader
+{
+    // "C8FS"
+    char magic[4];
+    uint32_t version;
+    uint32_t slots;
+    uint32_t slotSize;
+    // Newest complete frame, 0 before the first
+    std::atomic<uint64_t> sequence;
+    uint8_t reserved[40];
+};
+static_assert(sizeof(FrameRingHeader) == 64);
+static_assert(std::atomic<uint64_t>::is_always_lock_free);
+
+struct alignas(64) FrameSlot
+{
+    // Frame number held here, 0 while the slot is being rewritten
+    std::atomic<uint64_t> sequence;
+    uint64_t cycles;
+    uint16_t width;
+    uint16_t height;
+    // Bit n set when plane n has pixels set
+    uint8_t planes;
+    uint8_t reserved[11];
+    // Each plane packed like packFrame(), only width*height/8 bytes are used
+    std::array<std::array<uint8_t, Chip8::ScreenWidth * Chip8::ScreenHeight / 8>, Chip8::Planes> bits;
+};
+
+// Publishes frames into a POSIX shared memory object that other processes
+// map read-only, e.g. /dev/shm/<name> on Linux. The emulator packs each
+// frame straight into its slot and readers use it in place, so nothing is
+// allocated or copied per frame on either side.
+//
+// A slot is a seqlock: a reader notes its sequence, reads the frame and
+// checks the sequence again; if it changed the writer lapped the reader and
+// the frame must be dropped. The writer never waits for readers.
+class FrameRing : public FrameSink
+{
+public:
+    static constexpr uint32_t Version = 1;
+
+    FrameRing();
+    ~FrameRing();
+    FrameRing(const FrameRing&) = delete;
+    FrameRing& operator=(const FrameRing&) = delete;
+
+    // Replace any object of that name with a new ring of `slots` frames.
+    // The object outlives the process so readers can look at the last
+    // frames afterwards; remove it with shm_unlink() or rm /dev/shm/<name>.
+    bool create(const std::string& name, uint32_t slots, std::string& error);
+    bool publish(const Chip8& m) override;
+    uint64_t published() const { return header ? header->sequence.load(std::memory_order_relaxed) : 0; }
+
+private:
+    FrameRingHeader* header;
+    FrameSlot* slots;
+    size_t mappedSize;
+};
+
+// Read side of a FrameRing, in the same or another process
+class FrameRingReader
+{
+public:
+    FrameRingReader();
+    ~FrameRingReader();
+    FrameRingReader(const FrameRingReader&) = delete;
+    FrameRingReader& operator=(const FrameRingReader&) = delete;
+
+    bool open(const std::string& name, std::string& error);
+    // Newest frame number, 0 before the first
+    uint64_t latest() const { return header->sequence.load(std::memory_order_acquire); }
+    // The slot frame n goes in. Only holds frame n while valid(n) is true
+    const FrameSlot& slot(uint64_t n) const;
+    // Whether the slot still holds frame n, call after reading it
+    bool valid(uint64_t n) const;
+
+private:
+    const FrameRingHeader* header;
+    const FrameSlot* slots;
+    size_t mappedSize;
+};
+
+// Writes frames to a file or pipe, "-" being stdout: each frame either as a
+// PBM image (P4, a header then the pixels) or raw, the same pixels without
+// a header, width*height/8 bytes. XO-CHIP planes are merged, a pixel is set
+// if it is set on either; the shared memory ring keeps them apart.
+class FramePipe : public FrameSink
+{
+public:
+    enum Format { Raw, Pbm };
+
+    FramePipe();
+    ~FramePipe();
+    FramePipe(const FramePipe&) = delete;
+    FramePipe& operator=(const FramePipe&) = delete;
+
+    bool open(const std::string& filename, Format format);
+    // Blocks while the reader of a pipe falls behind
+    bool publish(const Chip8& m) override;
+    // Returns false if any write failed
+    bool close();
+
+private:
+    int fd;
+    Format format;
+    bool failed;
+    // One frame, header included, reused for every frame
+    std::array<uint8_t, 32 + Chip8::ScreenWidth * Chip8::ScreenHeight / 8> buffer;
+};
@@ -0,0 +1,746 @@
+#include "Jit.h"
+
+#include <algorithm>
+#include <cstring>
+
+#if defined(__x86_64__)
+#include <sys/mman.h>
+#endif
+
+namespace
+{
+    // Displacements of the machine state from rdi
+    const uint32_t REGS = offsetof(Chip8, regs);
+    const uint32_t PC = offsetof(Chip8, addrptr);
+    const uint32_t I = offsetof(Chip8, memptr);
+    const uint32_t DELAY = offsetof(Chip8, delay);
+    const uint32_t SOUND = offsetof(Chip8, sound);
+    const uint32_t SP = offsetof(Chip8, sp);
+    const uint32_t KEYS = offsetof(Chip8, keys);
+    const uint32_t RNG = offsetof(Chip8, rngState);
+    const uint32_t STACK = offsetof(Chip8, stack);
+    // Classic profiles only, memory is inline
+    const uint32_t MEMORY = offsetof(Chip8, classicMemory);
+
+    // x86 register numbers
+    const uint8_t EAX = 0, ECX = 1, EDX = 2;
+    // Callee-saved and spare registers that can hold V registers: rbx, rbp, r8-r15
+    const uint8_t hostRegs[10] = {3, 5, 8, 9, 10, 11, 12, 13, 14, 15};
+
+    // Largest block plus its exits, checked before every compile
+    const size_t MaxBlockBytes = 64 << 10;
+
+    enum Kind { Straight, Terminator, SideExit };
+
+    Kind classify(uint8_t handler)
+    {
+        switch (handler)
+        {
+        case Chip8::OpJump:
+        case Chip8::OpCall:
+        case Chip8::OpReturn:
+        case Chip8::OpJumpOffset:
+        case Chip8::OpSkipEqImm:
+        case Chip8::OpSkipNeqImm:
+        case Chip8::OpSkipEqReg:
+        case Chip8::OpSkipNeqReg:
+        case Chip8::OpSkipKey:
+        case Chip8::OpSkipNotKey:
+            return Terminator;
+        // These touch the screen, block on input or write memory
+        case Chip8::OpClear:
+        case Chip8::OpDraw:
+        case Chip8::OpWaitKey:
+        case Chip8::OpBcd:
+        case Chip8::OpStore:
+        case Chip8::OpNotDecoded:
+        case Chip8::OpExit:
+        case Chip8::OpLowRes:
+        case Chip8::OpHighRes:
+        case Chip8::OpScrollDown:
+        case Chip8::OpScrollRight:
+        case Chip8::OpScrollLeft:
+        case Chip8::OpDrawLarge:
+        case Chip8::OpSaveFlags:
+        case Chip8::OpLoadFlags:
+        // XO-CHIP, the JIT never runs with those quirks but the interpreter
+        // knows what they mean under the others
+        case Chip8::OpLongI:
+        case Chip8::OpPlanes:
+        case Chip8::OpAudio:
+        case Chip8::OpPitch:
+        case Chip8::OpSaveRange:
+        case Chip8::OpLoadRange:
+        case Chip8::OpScrollUp:
+            return SideExit;
+        default:
+            return Straight;
+        }
+    }
+}
+
+Jit::Jit(Chip8 &m) : machine(m), code(nullptr), codeUsed(0), leave(0)
+{
+#if defined(__x86_64__)
+    void* mem = mmap(nullptr, CodeSize, PROT_READ|PROT_WRITE|PROT_EXEC, MAP_PRIVATE|MAP_ANONYMOUS, -1, 0);
+    if (mem != MAP_FAILED)
+    {
+        code = static_cast<uint8_t*>(mem);
+    }
+#endif
+    flush();
+}
+
+Jit::~Jit()
+{
+#if defined(__x86_64__)
+    if (code)
+    {
+        munmap(code, CodeSize);
+    }
+#endif
+}
+
+void Jit::flush()
+{
+    codeUsed = 0;
+    entries.fill(nullptr);
+    blockAt.fill(-1);
+    uncompilable.fill(false);
+    for (auto &&p : pending)
+    {
+        p.clear();
+    }
+    for (auto &&p : pageBlocks)
+    {
+        p.clear();
+    }
+    blocks.clear();
+}
+
+uint64_t Jit::run(uint64_t n)
+{
+    const uint64_t start = machine.cycles;
+    const uint64_t end = start + n;
+    while (machine.cycles < end && !machine.done)
+    {
+        uint16_t pc = machine.addrptr;
+        void* entry = nullptr;
+        if (pc < Chip8::ClassicMemorySize - 1)
+        {
+            entry = entries[pc];
+            if (!entry && !uncompilable[pc] && compile(pc))
+            {
+                entry = entries[pc];
+            }
+        }
+        if (entry)
+        {
+            int64_t budget = (int64_t)std::min<uint64_t>(end - machine.cycles, INT64_MAX / 2);
+            int64_t left = reinterpret_cast<EnterFn>(code)(&machine, budget, entry);
+            if (left != budget)
+            {
+                machine.cycles += budget - left;
+                continue;
+            }
+        }
+        // Side exit, or the block did not fit in what is left of the budget
+        machine.interpret(1);
+        if (machine.addrptr == pc && machine.decoded[pc].handler == Chip8::OpWaitKey)
+        {
+            // Waiting for a key, which can not arrive before the next run
+            machine.cycles = end;
+        }
+    }
+    return machine.cycles - start;
+}
+
+void Jit::invalidate(uint16_t addr, uint16_t len)
+{
+    if (!code)
+    {
+        return;
+    }
+    for (uint16_t i = 0; i < len; i++)
+    {
+        uint16_t a = (addr + i) & (Chip8::ClassicMemorySize - 1);
+        uncompilable[a] = false;
+        uncompilable[(a - 1) & (Chip8::ClassicMemorySize - 1)] = false;
+        auto &list = pageBlocks[a >> PageShift];
+        for (size_t j = 0; j < list.size();)
+        {
+            Block &b = blocks[list[j]];
+            if (!b.live)
+            {
+                list[j] = list.back();
+                list.pop_back();
+                continue;
+            }
+            if (a >= b.start && a < b.end)
+            {
+                kill(list[j]);
+            }
+            j++;
+        }
+    }
+}
+
+void Jit::kill(int32_t index)
+{
+    Block &b = blocks[index];
+    b.live = false;
+    entries[b.start] = nullptr;
+    blockAt[b.start] = -1;
+    // Send everything that was chained to this block back through run()
+    for (uint32_t site : b.incoming)
+    {
+        patch(site, site + 4);
+        pending[b.start].push_back(site);
+    }
+    b.incoming.clear();
+}
+
+void Jit::patch(uint32_t site, uint32_t dest)
+{
+    int32_t rel = (int32_t)dest - (int32_t)(site + 4);
+    std::memcpy(code + site, &rel, 4);
+}
+
+void Jit::link(uint32_t site, uint16_t target)
+{
+    if (target >= Chip8::ClassicMemorySize - 1)
+    {
+        return;
+    }
+    if (blockAt[target] >= 0)
+    {
+        Block &b = blocks[blockAt[target]];
+        patch(site, b.entry);
+        b.incoming.push_back(site);
+    }
+    else
+    {
+        pending[target].push_back(site);
+    }
+}
+
+void Jit::emit16(uint16_t v)
+{
+    std::memcpy(code + codeUsed, &v, 2);
+    codeUsed += 2;
+}
+
+void Jit::emit32(uint32_t v)
+{
+    std::memcpy(code + codeUsed, &v, 4);
+    codeUsed += 4;
+}
+
+void Jit::emit64(uint64_t v)
+{
+    std::memcpy(code + codeUsed, &v, 8);
+    codeUsed += 8;
+}
+
+void Jit::emitModRm(uint8_t reg, uint32_t disp)
+{
+    // mod=10 (disp32), rm=111 (rdi)
+    emit8(0x80 | (reg << 3) | 7);
+    emit32(disp);
+}
+
+// Leave the block for `target`. The rel32 of the leading jmp initially points
+// at the code right after it, which returns to run(); link() later redirects
+// it straight into the target block.
+void Jit::emitExit(uint16_t target, int refund, bool chain)
+{
+    if (refund)
+    {
+        // add rsi, refund
+        emit8(0x48); emit8(0x83); emit8(0xc6); emit8(refund);
+    }
+    // jmp rel32
+    emit8(0xe9);
+    uint32_t site = codeUsed;
+    emit32(0);
+    // mov word [rdi+PC], target
+    emit8(0x66); emit8(0xc7); emitModRm(0, PC); emit16(target);
+    emitLeave();
+    if (chain)
+    {
+        link(site, target);
+    }
+}
+
+// Leave the block for the address in eax, which has already been stored to
+// addrptr. Jumps straight into the target block if there is one.
+void Jit::emitDynamicExit()
+{
+    // cmp eax, ClassicMemorySize-2; ja .leave
+    emit8(0x3d); emit32(Chip8::ClassicMemorySize - 2);
+    emit8(0x77); emit8(21);
+    // mov rcx, &entries; mov rcx, [rcx+rax*8]
+    emit8(0x48); emit8(0xb9); emit64((uint64_t)entries.data());
+    emit8(0x48); emit8(0x8b); emit8(0x0c); emit8(0xc1);
+    // test rcx, rcx; jz .leave; jmp rcx
+    emit8(0x48); emit8(0x85); emit8(0xc9);
+    emit8(0x74); emit8(2);
+    emit8(0xff); emit8(0xe1);
+    emitLeave();
+}
+
+void Jit::emitLeave()
+{
+    // jmp leave
+    emit8(0xe9);
+    emit32(0);
+    patch(codeUsed - 4, leave);
+}
+
+Jit::Operand Jit::V(uint8_t x) const
+{
+    Operand o;
+    o.host = hostReg[x] != 0;
+    o.reg = hostReg[x];
+    o.disp = REGS + x;
+    return o;
+}
+
+void Jit::emitRm(uint8_t op1, uint8_t op2, uint8_t reg, Operand rm)
+{
+    // REX.R/REX.B for r8-r15, and a plain REX so 4-7 mean spl-dil rather than ah-bh
+    uint8_t rex = 0;
+    if (reg >= 8)
+    {
+        rex |= 0x44;
+    }
+    else if (reg >= 4)
+    {
+        rex |= 0x40;
+    }
+    if (rm.host && rm.reg >= 8)
+    {
+        rex |= 0x41;
+    }
+    else if (rm.host && rm.reg >= 4)
+    {
+        rex |= 0x40;
+    }
+    if (rex)
+    {
+        emit8(rex);
+    }
+    emit8(op1);
+    if (op2)
+    {
+        emit8(op2);
+    }
+    if (rm.host)
+    {
+        emit8(0xc0 | ((reg & 7) << 3) | (rm.reg & 7));
+    }
+    else
+    {
+        emitModRm(reg & 7, rm.disp);
+    }
+}
+
+// Pick the host registers for this ROM and emit the shared entry and exit
+// code at the start of the buffer
+void Jit::emitPrologue()
+{
+    // Count how often each V register is named by the program
+    std::array<uint32_t, 16> uses {};
+    for (size_t pc = Chip8::ProgramStart; pc < Chip8::ClassicMemorySize - 1; pc += 2)
+    {
+        Chip8::DecodedOp op = Chip8::decode(((uint16_t)machine.memory[pc] << 8) | machine.memory[pc+1]);
+        if (op.handler == Chip8::OpUndefined)
+        {
+            continue;
+        }
+        uses[op.x]++;
+        uses[op.y]++;
+        if (op.handler >= Chip8::OpAdd && op.handler <= Chip8::OpShiftLeft)
+        {
+            uses[0xf]++;
+        }
+    }
+    std::array<uint8_t, 16> order;
+    for (uint8_t i = 0; i < 16; i++)
+    {
+        order[i] = i;
+    }
+    std::stable_sort(order.begin(), order.end(), [&uses](uint8_t a, uint8_t b) { return uses[a] > uses[b]; });
+    hostReg.fill(0);
+    for (int i = 0; i < 10; i++)
+    {
+        hostReg[order[i]] = hostRegs[i];
+    }
+
+    // Entry: push rbx, rbp, r12-r15, load the host registers, jmp rdx
+    emit8(0x53); emit8(0x55);
+    emit8(0x41); emit8(0x54); emit8(0x41); emit8(0x55);
+    emit8(0x41); emit8(0x56); emit8(0x41); emit8(0x57);
+    for (uint8_t x = 0; x < 16; x++)
+    {
+        if (hostReg[x])
+        {
+            // movzx host, byte [rdi+REGS+x]
+            Operand mem = V(x);
+            mem.host = false;
+            emitRm(0x0f, 0xb6, hostReg[x], mem);
+        }
+    }
+    emit8(0xff); emit8(0xe2);
+
+    // Exit: write the host registers back, pop, return the budget
+    leave = codeUsed;
+    for (uint8_t x = 0; x < 16; x++)
+    {
+        if (hostReg[x])
+        {
+            Operand mem = V(x);
+            mem.host = false;
+            emitRm(0x88, 0, hostReg[x], mem);
+        }
+    }
+    emit8(0x41); emit8(0x5f); emit8(0x41); emit8(0x5e);
+    emit8(0x41); emit8(0x5d); emit8(0x41); emit8(0x5c);
+    emit8(0x5d); emit8(0x5b);
+    emit8(0x48); emit8(0x89); emit8(0xf0);
+    emit8(0xc3);
+}
+
+bool Jit::compile(uint16_t start)
+{
+    // Find the extent of the block
+    std::vector<Chip8::DecodedOp> ops;
+    bool terminated = false;
+    for (uint16_t pc = start; pc < Chip8::ClassicMemorySize - 1 && ops.size() < MaxBlockLength; pc += 2)
+    {
+        Chip8::DecodedOp op = Chip8::decode(((uint16_t)machine.memory[pc] << 8) | machine.memory[pc+1]);
+        op.handler = Chip8::handlerUnder(op.handler, machine.quirks());
+        Kind kind = classify(op.handler);
+        if (kind == SideExit)
+        {
+            break;
+        }
+        ops.push_back(op);
+        if (kind == Terminator)
+        {
+            terminated = true;
+            break;
+        }
+    }
+    if (ops.empty())
+    {
+        uncompilable[start] = true;
+        return false;
+    }
+
+    if (CodeSize - codeUsed < MaxBlockBytes)
+    {
+        flush();
+    }
+    if (codeUsed == 0)
+    {
+        emitPrologue();
+    }
+
+    const uint8_t count = ops.size();
+    const uint32_t entry = codeUsed;
+
+    // sub rsi, count; jl bail
+    emit8(0x48); emit8(0x83); emit8(0xee); emit8(count);
+    emit8(0x0f); emit8(0x8c);
+    uint32_t bailSite = codeUsed;
+    emit32(0);
+
+    // Quirks are fixed for the life of a block, setQuirks() flushes
+    const Quirks& quirks = machine.quirks();
+    // Machine state that is never held in host registers
+    auto mem = [](uint32_t disp) { return Operand{false, 0, disp}; };
+    // Emit a two-way exit for skips: jcc to pc+4, fall through to pc+2
+    auto skip = [this](uint8_t jcc, uint16_t pc) {
+        emit8(0x0f); emit8(jcc);
+        uint32_t site = codeUsed;
+        emit32(0);
+        emitExit(pc + 2, 0, true);
+        patch(site, codeUsed);
+        emitExit(pc + 4, 0, true);
+    };
+
+    for (uint8_t i = 0; i < count; i++)
+    {
+        const Chip8::DecodedOp &op = ops[i];
+        const uint16_t pc = start + 2*i;
+        const Operand vx = V(op.x), vy = V(op.y), vf = V(0xf);
+        switch (op.handler)
+        {
+        case Chip8::OpUndefined:
+            break;
+
+        case Chip8::OpLoadImm:
+            // mov vx, nn
+            emitRm(0xc6, 0, 0, vx); emit8(op.nn);
+            break;
+
+        case Chip8::OpAddImm:
+            // add vx, nn
+            emitRm(0x80, 0, 0, vx); emit8(op.nn);
+            break;
+
+        case Chip8::OpMove:
+            load8(EAX, vy);
+            store8(EAX, vx);
+            break;
+
+        case Chip8::OpOr:
+        case Chip8::OpAnd:
+        case Chip8::OpXor:
+            load8(EAX, vx);
+            load8(ECX, vy);
+            // or/and/xor al, cl
+            emit8(op.handler == Chip8::OpOr ? 0x08 : op.handler == Chip8::OpAnd ? 0x20 : 0x30);
+            emit8(0xc8);
+            store8(EAX, vx);
+            if (quirks.vfReset)
+            {
+                // mov vf, 0
+                emitRm(0xc6, 0, 0, vf); emit8(0);
+            }
+            break;
+
+        case Chip8::OpAdd:
+        case Chip8::OpSub:
+        case Chip8::OpSubReverse:
+            load8(EAX, op.handler == Chip8::OpSubReverse ? vy : vx);
+            load8(ECX, op.handler == Chip8::OpSubReverse ? vx : vy);
+            if (op.handler == Chip8::OpAdd)
+            {
+                // add al, cl; setc dl
+                emit8(0x00); emit8(0xc8);
+                emit8(0x0f); emit8(0x92); emit8(0xc2);
+            }
+            else
+            {
+                // sub al, cl; setnc dl
+                emit8(0x28); emit8(0xc8);
+                emit8(0x0f); emit8(0x93); emit8(0xc2);
+            }
+            store8(EAX, vx);
+            store8(EDX, vf);
+            break;
+
+        case Chip8::OpShiftRight:
+            load8(EAX, quirks.shiftVx ? vx : vy);
+            // mov edx, eax; and edx, 1; shr al, 1
+            emit8(0x89); emit8(0xc2);
+            emit8(0x83); emit8(0xe2); emit8(0x01);
+            emit8(0xd0); emit8(0xe8);
+            store8(EAX, vx);
+            store8(EDX, vf);
+            break;
+
+        case Chip8::OpShiftLeft:
+            load8(EAX, quirks.shiftVx ? vx : vy);
+            // mov edx, eax; shr edx, 7; shl al, 1
+            emit8(0x89); emit8(0xc2);
+            emit8(0xc1); emit8(0xea); emit8(0x07);
+            emit8(0xd0); emit8(0xe0);
+            store8(EAX, vx);
+            store8(EDX, vf);
+            break;
+
+        case Chip8::OpLoadI:
+            // mov word [I], nnn
+            emit8(0x66); emit8(0xc7); emitModRm(0, I); emit16(op.nnn);
+            break;
+
+        case Chip8::OpAddI:
+            load8(EAX, vx);
+            // add word [I], ax
+            emit8(0x66); emit8(0x01); emitModRm(EAX, I);
+            break;
+
+        case Chip8::OpFont:
+            load8(EAX, vx);
+            // and eax, 15; imul eax, eax, 5; mov word [I], ax
+            emit8(0x83); emit8(0xe0); emit8(0x0f);
+            emit8(0x6b); emit8(0xc0); emit8(0x05);
+            emit8(0x66); emit8(0x89); emitModRm(EAX, I);
+            break;
+
+        case Chip8::OpBigFont:
+            load8(EAX, vx);
+            // and eax, 15; imul eax, eax, 10; add eax, BigFontStart; mov word [I], ax
+            emit8(0x83); emit8(0xe0); emit8(0x0f);
+            emit8(0x6b); emit8(0xc0); emit8(0x0a);
+            emit8(0x83); emit8(0xc0); emit8(Chip8::BigFontStart);
+            emit8(0x66); emit8(0x89); emitModRm(EAX, I);
+            break;
+
+        case Chip8::OpGetDelay:
+            load8(EAX, mem(DELAY));
+            store8(EAX, vx);
+            break;
+
+        case Chip8::OpSetDelay:
+            load8(EAX, vx);
+            store8(EAX, mem(DELAY));
+            break;
+
+        case Chip8::OpSetSound:
+            load8(EAX, vx);
+            store8(EAX, mem(SOUND));
+            break;
+
+        case Chip8::OpRandom:
+            // xorshift32, same as Chip8::random()
+            emit8(0x8b); emitModRm(EAX, RNG);
+            emit8(0x89); emit8(0xc2);
+            emit8(0xc1); emit8(0xe2); emit8(13);
+            emit8(0x31); emit8(0xd0);
+            emit8(0x89); emit8(0xc2);
+            emit8(0xc1); emit8(0xea); emit8(17);
+            emit8(0x31); emit8(0xd0);
+            emit8(0x89); emit8(0xc2);
+            emit8(0xc1); emit8(0xe2); emit8(5);
+            emit8(0x31); emit8(0xd0);
+            emit8(0x89); emitModRm(EAX, RNG);
+            // shr eax, 24; and al, nn
+            emit8(0xc1); emit8(0xe8); emit8(24);
+            emit8(0x24); emit8(op.nn);
+            store8(EAX, vx);
+            break;
+
+        case Chip8::OpLoad:
+            // movzx eax, word [I]
+            emit8(0x0f); emit8(0xb7); emitModRm(EAX, I);
+            for (uint8_t r = 0; r <= op.x; r++)
+            {
+                // lea edx, [rax+r]; and edx, 0xfff; movzx ecx, byte [rdi+rdx+MEMORY]
+                emit8(0x8d); emit8(0x50); emit8(r);
+                emit8(0x81); emit8(0xe2); emit32(Chip8::ClassicMemorySize - 1);
+                emit8(0x0f); emit8(0xb6); emit8(0x8c); emit8(0x17); emit32(MEMORY);
+                store8(ECX, V(r));
+            }
+            if (uint8_t advance = quirks.index == Quirks::IndexKept ? 0 : op.x + (quirks.index == Quirks::IndexAfter))
+            {
+                // add word [I], advance
+                emit8(0x66); emit8(0x83); emitModRm(0, I); emit8(advance);
+            }
+            break;
+
+        case Chip8::OpJump:
+            emitExit(op.nnn, 0, true);
+            break;
+
+        case Chip8::OpCall:
+        {
+            // cmp byte [SP], StackDepth; jb push
+            emit8(0x80); emitModRm(7, SP); emit8(Chip8::StackDepth);
+            emit8(0x0f); emit8(0x82);
+            uint32_t site = codeUsed;
+            emit32(0);
+            // Overflow is handled by the interpreter
+            emitExit(pc, count - i, false);
+            patch(site, codeUsed);
+            // movzx eax, byte [SP]; mov word [rdi+rax*2+STACK], pc; inc byte [SP]
+            load8(EAX, mem(SP));
+            emit8(0x66); emit8(0xc7); emit8(0x84); emit8(0x47); emit32(STACK); emit16(pc);
+            emit8(0xfe); emitModRm(0, SP);
+            emitExit(op.nnn, 0, true);
+            break;
+        }
+
+        case Chip8::OpReturn:
+        {
+            // cmp byte [SP], 0; jne pop
+            emit8(0x80); emitModRm(7, SP); emit8(0);
+            emit8(0x0f); emit8(0x85);
+            uint32_t site = codeUsed;
+            emit32(0);
+            // Returning with an empty stack stops the machine, leave that to the interpreter
+            emitExit(pc, count - i, false);
+            patch(site, codeUsed);
+            // dec byte [SP]; movzx eax, byte [SP]; movzx eax, word [rdi+rax*2+STACK]
+            emit8(0xfe); emitModRm(1, SP);
+            load8(EAX, mem(SP));
+            emit8(0x0f); emit8(0xb7); emit8(0x84); emit8(0x47); emit32(STACK);
+            // add eax, 2; mov word [PC], ax
+            emit8(0x83); emit8(0xc0); emit8(0x02);
+            emit8(0x66); emit8(0x89); emitModRm(EAX, PC);
+            emitDynamicExit();
+            break;
+        }
+
+        case Chip8::OpJumpOffset:
+            load8(EAX, V(quirks.jumpVx ? op.x : 0));
+            // add eax, nnn; and eax, 0xfff; mov word [PC], ax
+            emit8(0x05); emit32(op.nnn);
+            emit8(0x25); emit32(0x0fff);
+            emit8(0x66); emit8(0x89); emitModRm(EAX, PC);
+            emitDynamicExit();
+            break;
+
+        case Chip8::OpSkipEqImm:
+        case Chip8::OpSkipNeqImm:
+            // cmp vx, nn; je/jne
+            emitRm(0x80, 0, 7, vx); emit8(op.nn);
+            skip(op.handler == Chip8::OpSkipEqImm ? 0x84 : 0x85, pc);
+            break;
+
+        case Chip8::OpSkipEqReg:
+        case Chip8::OpSkipNeqReg:
+            load8(EAX, vx);
+            // cmp al, vy; je/jne
+            emitRm(0x3a, 0, EAX, vy);
+            skip(op.handler == Chip8::OpSkipEqReg ? 0x84 : 0x85, pc);
+            break;
+
+        case Chip8::OpSkipKey:
+        case Chip8::OpSkipNotKey:
+            load8(ECX, vx);
+            // and ecx, 15; movzx eax, word [KEYS]; bt eax, ecx; jc/jnc
+            emit8(0x83); emit8(0xe1); emit8(0x0f);
+            emit8(0x0f); emit8(0xb7); emitModRm(EAX, KEYS);
+            emit8(0x0f); emit8(0xa3); emit8(0xc8);
+            skip(op.handler == Chip8::OpSkipKey ? 0x82 : 0x83, pc);
+            break;
+        }
+    }
+    if (!terminated)
+    {
+        // Ran into a side exit or the length limit
+        emitExit(start + 2*count, 0, true);
+    }
+
+    // bail: not enough budget left for the whole block
+    patch(bailSite, codeUsed);
+    emit8(0x48); emit8(0x83); emit8(0xc6); emit8(count);
+    emit8(0x66); emit8(0xc7); emitModRm(0, PC); emit16(start);
+    emitLeave();
+
+    // Register the block and resolve exits that were waiting for it
+    int32_t index = blocks.size();
+    Block b;
+    b.start = start;
+    b.end = start + 2*count;
+    b.entry = entry;
+    b.live = true;
+    blocks.push_back(b);
+    blockAt[start] = index;
+    entries[start] = code + entry;
+    for (uint32_t site : pending[start])
+    {
+        patch(site, entry);
+        blocks[index].incoming.push_back(site);
+    }
+    pending[start].clear();
+    for (int page = b.start >> PageShift; page <= (b.end - 1) >> PageShift; page++)
+    {
+        pageBlocks[page].push_back(index);
+    }
+    return true;
+}
@@ -0,0 +1,97 @@
+#pragma once
+
+#include <array>
+#include <cstdint>
+#include <cstddef>
+#include <vector>
+
+#include "Chip8.h"
+
+// Basic-block JIT for x86-64. Straight-line runs of instructions up to the
+// next jump, call, return or skip are translated to native code. The ten
+// most used V registers of the ROM live in host registers for as long as
+// execution stays in generated code; the rest are accessed in memory.
+// Blocks are cached by start address and chained to each other by patching
+// their exit jumps. Anything the JIT does not translate (Dxyn, 00E0, Fx0A,
+// Fx33, Fx55, the SUPER-CHIP screen, exit and flag instructions and the
+// XO-CHIP ones) ends the block and is run by Chip8::interpret(). Only covers
+// the 4 KB machine; Chip8::step() does not use it under the XO-CHIP quirks.
+class Jit
+{
+public:
+    explicit Jit(Chip8 &m);
+    ~Jit();
+    Jit(const Jit&) = delete;
+    Jit& operator=(const Jit&) = delete;
+
+    // False if executable memory could not be mapped or the host is not x86-64
+    bool available() const { return code != nullptr; }
+    uint64_t run(uint64_t n);
+    // Drop every block containing a byte in [addr, addr+len)
+    void invalidate(uint16_t addr, uint16_t len);
+    void flush();
+
+private:
+    // The prologue at the start of the code buffer loads the host registers
+    // and jumps to `block`; every exit goes through the matching epilogue,
+    // which returns the budget left over
+    typedef int64_t (*EnterFn)(Chip8* m, int64_t budget, void* block);
+
+    // A V register operand, either a host register or [rdi+disp]
+    struct Operand
+    {
+        bool host;
+        uint8_t reg;
+        uint32_t disp;
+    };
+
+    static constexpr size_t CodeSize = 4 << 20;
+    static constexpr int MaxBlockLength = 64;
+    static constexpr int PageShift = 6;
+
+    struct Block
+    {
+        uint16_t start, end;
+        uint32_t entry;
+        bool live;
+        // Offsets of the rel32 fields of exits that jump into this block
+        std::vector<uint32_t> incoming;
+    };
+
+    Chip8 &machine;
+    uint8_t* code;
+    size_t codeUsed;
+    uint32_t leave;
+    // Host register holding each V register, or 0 if it stays in memory
+    std::array<uint8_t, 16> hostReg;
+    // Entry point per address, read by generated code for 00EE and Bnnn
+    std::array<void*, Chip8::ClassicMemorySize> entries;
+    std::array<int32_t, Chip8::ClassicMemorySize> blockAt;
+    std::array<bool, Chip8::ClassicMemorySize> uncompilable;
+    // Exits waiting for a block to appear at their target address
+    std::array<std::vector<uint32_t>, Chip8::ClassicMemorySize> pending;
+    std::array<std::vector<int32_t>, (Chip8::ClassicMemorySize >> PageShift)> pageBlocks;
+    std::vector<Block> blocks;
+
+    bool compile(uint16_t start);
+    void emitPrologue();
+    Operand V(uint8_t x) const;
+    void kill(int32_t b);
+    void link(uint32_t site, uint16_t target);
+    void patch(uint32_t site, uint32_t dest);
+
+    // Emitters, all memory operands are [rdi + disp32]
+    void emit8(uint8_t b) { code[codeUsed++] = b; }
+    void emit16(uint16_t v);
+    void emit32(uint32_t v);
+    void emit64(uint64_t v);
+    void emitModRm(uint8_t reg, uint32_t disp);
+    // Opcode with a ModRM byte whose r/m is `rm`, adding REX as needed for
+    // byte registers
+    void emitRm(uint8_t op1, uint8_t op2, uint8_t reg, Operand rm);
+    void load8(uint8_t reg, Operand v) { emitRm(0x0f, 0xb6, reg, v); }
+    void store8(uint8_t reg, Operand v) { emitRm(0x88, 0, reg, v); }
+    void emitLeave();
+    void emitExit(uint16_t target, int refund, bool chain);
+    void emitDynamicExit();
+};
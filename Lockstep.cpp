@@ -0,0 +1,637 @@
+#include "Lockstep.h"
+#include "Rom.h"
+
+#include <algorithm>
+#include <bit>
+#include <cstring>
+
+#ifdef __SSE2__
+#include <immintrin.h>
+#endif
+
+namespace
+{
+    // One bit per lane from a byte mask
+    template<typename Mask8>
+    uint32_t laneBits(const Mask8& m)
+    {
+        constexpr int lanes = sizeof(Mask8);
+        #ifdef __AVX2__
+        if constexpr (lanes == 32)
+        {
+            return (uint32_t)_mm256_movemask_epi8((__m256i)m);
+        }
+        #endif
+        #ifdef __SSE2__
+        if constexpr (lanes == 32)
+        {
+            __m128i lo, hi;
+            std::memcpy(&lo, &m, 16);
+            std::memcpy(&hi, (const char*)&m + 16, 16);
+            return (uint32_t)_mm_movemask_epi8(lo) | ((uint32_t)_mm_movemask_epi8(hi) << 16);
+        }
+        else if constexpr (lanes == 16)
+        {
+            return (uint32_t)_mm_movemask_epi8((__m128i)m);
+        }
+        else
+        {
+            return (uint32_t)_mm_movemask_epi8(_mm_loadl_epi64((const __m128i*)&m));
+        }
+        #else
+        uint32_t bits = 0;
+        for (int l = 0; l < lanes; l++)
+        {
+            bits |= (uint32_t)(m[l] & 1) << l;
+        }
+        return bits;
+        #endif
+    }
+}
+
+// Visit every lane set in a bitmask
+#define FOR_LANES(l, bits) for (uint32_t b_ = (bits), l; b_ && (l = __builtin_ctz(b_), true); b_ &= b_ - 1)
+
+template<int Lanes>
+Lockstep<Lanes>::Lockstep()
+{
+    for (int l = 0; l < Lanes; l++)
+    {
+        rngState[l] = 0x2545f491;
+    }
+    reset();
+}
+
+template<int Lanes>
+void Lockstep<Lanes>::reset()
+{
+    for (auto &&r : regs)
+    {
+        r = Bytes{};
+    }
+    addrptr = Words{} + Chip8::ProgramStart;
+    memptr = Words{};
+    keys = Words{};
+    lastKeys = Words{};
+    delay = Bytes{};
+    sound = Bytes{};
+    sp = Bytes{};
+    done = Bytes{};
+    exitReason = Bytes{} + (uint8_t)Chip8::ExitRunning;
+    waitingForKey = Bytes{};
+    left = Dwords{};
+    cycles.fill(0);
+    for (int l = 0; l < Lanes; l++)
+    {
+        stack[l].fill(0);
+        pixels[l].fill(0);
+        memory[l].fill(0);
+        std::copy(Chip8::font, Chip8::font+80, memory[l].begin());
+        std::copy(Chip8::bigFont, Chip8::bigFont+160, memory[l].begin() + Chip8::BigFontStart);
+    }
+    for (auto &&op : decoded)
+    {
+        op.handler = Chip8::OpNotDecoded;
+    }
+    written.fill(false);
+}
+
+template<int Lanes>
+void Lockstep<Lanes>::seed(int lane, uint32_t s)
+{
+    // xorshift32 must never be seeded with zero
+    rngState[lane] = s ? s : 0x2545f491;
+}
+
+template<int Lanes>
+bool Lockstep<Lanes>::load(const uint8_t* data, size_t size)
+{
+    if (size > Chip8::ClassicMemorySize - Chip8::ProgramStart)
+    {
+        return false;
+    }
+    for (int l = 0; l < Lanes; l++)
+    {
+        std::copy(data, data+size, memory[l].begin() + Chip8::ProgramStart);
+    }
+    for (auto &&op : decoded)
+    {
+        op.handler = Chip8::OpNotDecoded;
+    }
+    return true;
+}
+
+template<int Lanes>
+bool Lockstep<Lanes>::loadFile(const std::string& filename)
+{
+    RomFile rom;
+    std::string error;
+    return rom.open(filename, error) && load(rom.data(), rom.size());
+}
+
+template<int Lanes>
+uint32_t Lockstep<Lanes>::running() const
+{
+    return laneBits(done == 0);
+}
+
+template<int Lanes>
+void Lockstep<Lanes>::storeByte(int lane, uint16_t addr, uint8_t value)
+{
+    memory[lane][addr] = value;
+    // Lanes may now hold different code here, stop sharing its decode
+    written[addr] = true;
+}
+
+template<int Lanes>
+bool Lockstep<Lanes>::drawSprite(int lane, uint8_t x, uint8_t y, uint8_t height)
+{
+    uint64_t collision = 0;
+    for (uint8_t i = 0; i < height; i++)
+    {
+        uint8_t row = memory[lane][(memptr[lane] + i) & 0xfff];
+        uint64_t sprite = std::rotr((uint64_t)row << 56, x % Chip8::LowResWidth);
+        int r = (y + i) % Chip8::LowResHeight;
+        collision |= pixels[lane][r] & sprite;
+        pixels[lane][r] ^= sprite;
+    }
+    return collision != 0;
+}
+
+template<int Lanes>
+void Lockstep<Lanes>::laneMasks(uint32_t bits, Mask8& m8, Words& m16, Dwords& m32)
+{
+    for (int l = 0; l < Lanes; l++)
+    {
+        int on = (bits >> l) & 1;
+        m8[l] = -on;
+        m16[l] = -on;
+        m32[l] = -on;
+    }
+}
+
+// Replace a by b in the lanes set in mask. Plain bitwise operations, which
+// GCC splits well for vectors wider than the host registers unlike ?: and
+// compares, so these are used for the 16 and 32-bit fields.
+#define BLEND(a, b, mask) a = ((a) & ~(mask)) | ((b) & (mask))
+
+template<int Lanes>
+void Lockstep<Lanes>::runFrame(uint32_t n)
+{
+    const uint32_t frame = running();
+    Mask8 m8;
+    Words m16;
+    Dwords m32;
+    laneMasks(frame, m8, m16, m32);
+    left = (Dwords{} + n) & m32;
+    // Lanes that still have instructions to run this frame
+    uint32_t live = n ? frame : 0;
+
+    // Lanes running the current instruction, m8/m16/m32 hold the same set.
+    // While `uniform` they all sit at `pc`, and while `pending` that pc has
+    // not been written back to addrptr yet.
+    uint32_t group = 0;
+    uint16_t pc = 0;
+    bool uniform = false;
+    bool pending = false;
+    // Instructions the group ran since `left` was last updated, and how many
+    // it may run before its first lane reaches the end of the frame
+    uint32_t run = 0;
+    uint32_t budget = 0;
+
+    auto catchUp = [&]()
+    {
+        if (pending)
+        {
+            BLEND(addrptr, Words{} + pc, m16);
+            pending = false;
+        }
+        if (run)
+        {
+            left -= run & m32;
+            FOR_LANES(l, group)
+            {
+                if (left[l] == 0)
+                {
+                    live &= ~(1u << l);
+                }
+            }
+            run = 0;
+        }
+    };
+
+    while (live)
+    {
+        Chip8::DecodedOp op;
+        if (uniform && group == live && run < budget && pc < Chip8::ClassicMemorySize - 1 && !(written[pc] | written[pc + 1]))
+        {
+            // Fast path, every running lane is still at the same instruction
+            if (decoded[pc].handler == Chip8::OpNotDecoded)
+            {
+                decoded[pc] = decode(fetch(__builtin_ctz(group), pc));
+            }
+            op = decoded[pc];
+        }
+        else
+        {
+            catchUp();
+            if (!live)
+            {
+                break;
+            }
+            // Run the lanes at the lowest PC so lanes behind can catch up
+            pc = 0xffff;
+            FOR_LANES(l, live)
+            {
+                pc = std::min(pc, addrptr[l]);
+            }
+            uint32_t at = 0;
+            FOR_LANES(l, live)
+            {
+                if (addrptr[l] == pc)
+                {
+                    at |= 1u << l;
+                }
+            }
+
+            if (pc >= Chip8::ClassicMemorySize - 1)
+            {
+                FOR_LANES(l, at)
+                {
+                    done[l] = true;
+                    exitReason[l] = Chip8::ExitPcOutOfRange;
+                }
+                live &= ~at;
+                uniform = false;
+                continue;
+            }
+
+            if (written[pc] | written[pc + 1])
+            {
+                // Self-modified code may differ between lanes, only the ones
+                // holding the same instruction as the first go together
+                uint16_t inst = fetch(__builtin_ctz(at), pc);
+                FOR_LANES(l, at)
+                {
+                    if (fetch(l, pc) != inst)
+                    {
+                        at &= ~(1u << l);
+                    }
+                }
+                op = decode(inst);
+            }
+            else
+            {
+                if (decoded[pc].handler == Chip8::OpNotDecoded)
+                {
+                    decoded[pc] = decode(fetch(__builtin_ctz(at), pc));
+                }
+                op = decoded[pc];
+            }
+
+            if (at != group)
+            {
+                group = at;
+                laneMasks(group, m8, m16, m32);
+            }
+            budget = UINT32_MAX;
+            FOR_LANES(l, group)
+            {
+                budget = std::min(budget, left[l]);
+            }
+            uniform = true;
+        }
+        run++;
+
+        #define REGX regs[op.x]
+        #define REGY regs[op.y]
+        #define VF regs[0xf]
+        #define NEXT() pc += 2; pending = true
+        // Lanes set in `taken` continue at pc+a, the rest of the group at pc+b
+        #define BRANCH(taken, a, b) \
+            { \
+                uint32_t t_ = (taken) & group; \
+                if (t_ == 0 || t_ == group) \
+                { \
+                    pc += t_ ? (a) : (b); \
+                    pending = true; \
+                } \
+                else \
+                { \
+                    FOR_LANES(l, group) \
+                    { \
+                        addrptr[l] = pc + ((t_ >> l) & 1 ? (a) : (b)); \
+                    } \
+                    uniform = false; \
+                    pending = false; \
+                } \
+            }
+        #define SKIP(cond) BRANCH(laneBits(cond), 4, 2)
+
+        switch (op.handler)
+        {
+        case Chip8::OpClear:
+            FOR_LANES(l, group)
+            {
+                pixels[l].fill(0);
+            }
+            NEXT();
+            break;
+        case Chip8::OpReturn:
+            FOR_LANES(l, group)
+            {
+                if (sp[l] == 0)
+                {
+                    done[l] = true;
+                    exitReason[l] = Chip8::ExitReturnEmptyStack;
+                    live &= ~(1u << l);
+                    addrptr[l] = pc + 2;
+                }
+                else
+                {
+                    addrptr[l] = stack[l][--sp[l]] + 2;
+                }
+            }
+            uniform = false;
+            pending = false;
+            break;
+        case Chip8::OpJump:
+            pc = op.nnn;
+            pending = true;
+            break;
+        case Chip8::OpCall:
+            FOR_LANES(l, group)
+            {
+                if (sp[l] == Chip8::StackDepth)
+                {
+                    done[l] = true;
+                    exitReason[l] = Chip8::ExitStackOverflow;
+                    live &= ~(1u << l);
+                    addrptr[l] = pc + 2;
+                }
+                else
+                {
+                    stack[l][sp[l]++] = pc;
+                    addrptr[l] = op.nnn;
+                }
+            }
+            // The lanes still running all went to nnn
+            pc = op.nnn;
+            pending = false;
+            break;
+        case Chip8::OpSkipEqImm:
+            SKIP(REGX == op.nn);
+            break;
+        case Chip8::OpSkipNeqImm:
+            SKIP(REGX != op.nn);
+            break;
+        case Chip8::OpSkipEqReg:
+            SKIP(REGX == REGY);
+            break;
+        case Chip8::OpLoadImm:
+            REGX = m8 ? Bytes{} + op.nn : REGX;
+            NEXT();
+            break;
+        case Chip8::OpAddImm:
+            REGX = m8 ? REGX + op.nn : REGX;
+            NEXT();
+            break;
+        case Chip8::OpMove:
+            REGX = m8 ? REGY : REGX;
+            NEXT();
+            break;
+        case Chip8::OpOr:
+            REGX = m8 ? (REGX | REGY) : REGX;
+            NEXT();
+            break;
+        case Chip8::OpAnd:
+            REGX = m8 ? (REGX & REGY) : REGX;
+            NEXT();
+            break;
+        case Chip8::OpXor:
+            REGX = m8 ? (REGX ^ REGY) : REGX;
+            NEXT();
+            break;
+        case Chip8::OpAdd:
+            {
+                Bytes sum = REGX + REGY;
+                Bytes carry = (Bytes)(sum < REGX) & 1;
+                REGX = m8 ? sum : REGX;
+                VF = m8 ? carry : VF;
+            }
+            NEXT();
+            break;
+        case Chip8::OpSub:
+            {
+                Bytes borrow = (Bytes)(REGX >= REGY) & 1;
+                REGX = m8 ? REGX - REGY : REGX;
+                VF = m8 ? borrow : VF;
+            }
+            NEXT();
+            break;
+        case Chip8::OpShiftRight:
+            {
+                Bytes out = REGY & 1;
+                REGX = m8 ? REGY >> 1 : REGX;
+                VF = m8 ? out : VF;
+            }
+            NEXT();
+            break;
+        case Chip8::OpSubReverse:
+            {
+                Bytes borrow = (Bytes)(REGY >= REGX) & 1;
+                REGX = m8 ? REGY - REGX : REGX;
+                VF = m8 ? borrow : VF;
+            }
+            NEXT();
+            break;
+        case Chip8::OpShiftLeft:
+            {
+                Bytes out = REGY >> 7;
+                REGX = m8 ? REGY << 1 : REGX;
+                VF = m8 ? out : VF;
+            }
+            NEXT();
+            break;
+        case Chip8::OpSkipNeqReg:
+            SKIP(REGX != REGY);
+            break;
+        case Chip8::OpLoadI:
+            BLEND(memptr, Words{} + op.nnn, m16);
+            NEXT();
+            break;
+        case Chip8::OpJumpOffset:
+            BLEND(addrptr, (__builtin_convertvector(regs[0], Words) + op.nnn) & 0x0fff, m16);
+            uniform = false;
+            pending = false;
+            break;
+        case Chip8::OpRandom:
+            {
+                // xorshift32 on every lane, same as Chip8::random()
+                Dwords r = rngState;
+                r ^= r << 13;
+                r ^= r >> 17;
+                r ^= r << 5;
+                BLEND(rngState, r, m32);
+                REGX = m8 ? __builtin_convertvector(r >> 24, Bytes) & op.nn : REGX;
+            }
+            NEXT();
+            break;
+        case Chip8::OpDraw:
+            FOR_LANES(l, group)
+            {
+                regs[0xf][l] = drawSprite(l, regs[op.x][l], regs[op.y][l], op.n);
+            }
+            NEXT();
+            break;
+        case Chip8::OpSkipKey:
+        case Chip8::OpSkipNotKey:
+            {
+                uint32_t held = 0;
+                FOR_LANES(l, group)
+                {
+                    held |= ((keys[l] >> (regs[op.x][l] & 0xf)) & 1u) << l;
+                }
+                if (op.handler == Chip8::OpSkipNotKey)
+                {
+                    held = ~held;
+                }
+                BRANCH(held, 4, 2);
+            }
+            break;
+        case Chip8::OpGetDelay:
+            REGX = m8 ? delay : REGX;
+            NEXT();
+            break;
+        case Chip8::OpWaitKey:
+            {
+                // Lanes without a new key press run this instruction again.
+                // Keys held when the wait started do not count, as in Chip8.
+                uint32_t pressedLanes = 0;
+                FOR_LANES(l, group)
+                {
+                    if (!waitingForKey[l])
+                    {
+                        lastKeys[l] = keys[l];
+                        waitingForKey[l] = true;
+                    }
+                    uint16_t pressed = keys[l] & ~lastKeys[l];
+                    lastKeys[l] = keys[l];
+                    if (pressed)
+                    {
+                        waitingForKey[l] = false;
+                        regs[op.x][l] = __builtin_ctz(pressed);
+                        pressedLanes |= 1u << l;
+                    }
+                }
+                BRANCH(pressedLanes, 2, 0);
+            }
+            break;
+        case Chip8::OpSetDelay:
+            delay = m8 ? REGX : delay;
+            NEXT();
+            break;
+        case Chip8::OpSetSound:
+            sound = m8 ? REGX : sound;
+            NEXT();
+            break;
+        case Chip8::OpAddI:
+            BLEND(memptr, memptr + __builtin_convertvector(REGX, Words), m16);
+            NEXT();
+            break;
+        case Chip8::OpFont:
+            BLEND(memptr, __builtin_convertvector(REGX & 0xf, Words) * 5, m16);
+            NEXT();
+            break;
+        case Chip8::OpBcd:
+            FOR_LANES(l, group)
+            {
+                uint8_t v = regs[op.x][l];
+                storeByte(l, memptr[l] & 0xfff, v/100);
+                storeByte(l, (memptr[l]+1) & 0xfff, (v%100)/10);
+                storeByte(l, (memptr[l]+2) & 0xfff, v%10);
+            }
+            NEXT();
+            break;
+        case Chip8::OpStore:
+            FOR_LANES(l, group)
+            {
+                for (uint8_t r = 0; r <= op.x; r++)
+                {
+                    storeByte(l, memptr[l] & 0xfff, regs[r][l]);
+                    memptr[l]++;
+                }
+            }
+            NEXT();
+            break;
+        case Chip8::OpLoad:
+            FOR_LANES(l, group)
+            {
+                for (uint8_t r = 0; r <= op.x; r++)
+                {
+                    regs[r][l] = memory[l][memptr[l] & 0xfff];
+                    memptr[l]++;
+                }
+            }
+            NEXT();
+            break;
+        default:
+            // Undefined instructions are skipped
+            NEXT();
+            break;
+        }
+
+        #undef REGX
+        #undef REGY
+        #undef VF
+        #undef NEXT
+        #undef BRANCH
+        #undef SKIP
+    }
+    catchUp();
+
+    FOR_LANES(l, frame)
+    {
+        cycles[l] += n - left[l];
+    }
+    // Decrement delay and sound on the lanes that ran this frame
+    laneMasks(frame, m8, m16, m32);
+    delay = m8 ? delay - ((Bytes)(delay != 0) & 1) : delay;
+    sound = m8 ? sound - ((Bytes)(sound != 0) & 1) : sound;
+}
+
+#undef BLEND
+
+template<int Lanes>
+void Lockstep<Lanes>::extract(int lane, Chip8& m) const
+{
+    m.reset();
+    for (int r = 0; r < 16; r++)
+    {
+        m.regs[r] = regs[r][lane];
+    }
+    m.addrptr = addrptr[lane];
+    m.memptr = memptr[lane];
+    m.delay = delay[lane];
+    m.sound = sound[lane];
+    m.sp = sp[lane];
+    m.done = done[lane];
+    m.exitReason = exitReason[lane];
+    m.waitingForKey = waitingForKey[lane];
+    m.keys = keys[lane];
+    m.lastKeys = lastKeys[lane];
+    m.rngState = rngState[lane];
+    m.cycles = cycles[lane];
+    m.stack = stack[lane];
+    std::copy(memory[lane].begin(), memory[lane].end(), m.memory);
+    for (int r = 0; r < Chip8::LowResHeight; r++)
+    {
+        m.pixels[0][r] = (Chip8::Row)pixels[lane][r] << 64;
+    }
+}
+
+#undef FOR_LANES
+
+template struct Lockstep<8>;
+template struct Lockstep<16>;
+template struct Lockstep<32>;
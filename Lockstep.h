@@ -0,0 +1,107 @@
+#pragma once
+
+#include <array>
+#include <cstdint>
+#include <cstddef>
+#include <string>
+
+#include "Chip8.h"
+
+// GCC vector of one T per lane. Declared outside Lockstep because the
+// vector_size attribute is not applied to typedefs in a class template
+// unless the element type is dependent.
+template<typename T, int Lanes>
+struct LaneVector
+{
+    typedef T type __attribute__((vector_size(Lanes * sizeof(T))));
+};
+
+// Runs Lanes instances of the same ROM side by side, for sweeping seeds or
+// inputs over one program. State is stored structure-of-arrays: one vector
+// per register, pointer and timer with one element per instance, so ALU
+// instructions, skips, jumps and timer updates run on all lanes at once.
+// When lanes branch differently the ones at the lowest PC run first and the
+// rest are masked off until they meet again. Stack, memory and screen
+// instructions loop over the lanes that take part.
+//
+// Every lane stays bit-identical to a Chip8 with the same seed and keys under
+// the modern quirks, the only ones implemented. The SUPER-CHIP and XO-CHIP
+// instructions run as they do there, see Chip8::handlerUnder().
+// Uses GCC vector extensions; build with -mavx2 for 256-bit operations.
+template<int Lanes>
+struct alignas(64) Lockstep
+{
+    static_assert(Lanes == 8 || Lanes == 16 || Lanes == 32, "8, 16 or 32 lanes");
+
+    typedef typename LaneVector<uint8_t, Lanes>::type Bytes;
+    typedef typename LaneVector<uint16_t, Lanes>::type Words;
+    typedef typename LaneVector<uint32_t, Lanes>::type Dwords;
+    // Lane masks, all ones where the lane takes part
+    typedef typename LaneVector<int8_t, Lanes>::type Mask8;
+    typedef typename LaneVector<int16_t, Lanes>::type Mask16;
+    typedef typename LaneVector<int32_t, Lanes>::type Mask32;
+
+    // regs[x][lane]
+    std::array<Bytes, 16> regs;
+    Words addrptr;
+    Words memptr;
+    // Set keys[lane] between frames, same as Chip8::keys
+    Words keys;
+    Words lastKeys;
+    Bytes delay;
+    Bytes sound;
+    Bytes sp;
+    Bytes done;
+    Bytes exitReason;
+    Bytes waitingForKey;
+    Dwords rngState;
+    std::array<uint64_t, Lanes> cycles;
+
+    std::array<std::array<uint16_t, Chip8::StackDepth>, Lanes> stack;
+    // Classic 64x32 screens only, one word per row like the left half of Chip8::pixels
+    std::array<std::array<uint64_t, Chip8::LowResHeight>, Lanes> pixels;
+    std::array<std::array<uint8_t, Chip8::ClassicMemorySize>, Lanes> memory;
+
+    Lockstep();
+    // Reset every lane, seeds are kept
+    void reset();
+    // Copy a ROM image to 0x200 in every lane
+    bool load(const uint8_t* data, size_t size);
+    bool loadFile(const std::string& filename);
+    void seed(int lane, uint32_t s);
+
+    // Execute one 60 Hz frame of n instructions on every lane that has not
+    // stopped, then tick their timers, same as Chip8::runFrame()
+    void runFrame(uint32_t n);
+    // Bit n is set while lane n has not stopped
+    uint32_t running() const;
+
+    // Copy one lane into a scalar machine
+    void extract(int lane, Chip8& m) const;
+
+private:
+    // Instructions left in the current frame
+    Dwords left;
+    // Decode cache shared by all lanes; only used where no lane has written
+    std::array<Chip8::DecodedOp, Chip8::ClassicMemorySize> decoded;
+    std::array<bool, Chip8::ClassicMemorySize> written;
+
+    uint16_t fetch(int lane, uint16_t pc) const
+    {
+        return ((uint16_t)memory[lane][pc] << 8) | memory[lane][pc + 1];
+    }
+    // Decoded as it runs under the modern quirks
+    static Chip8::DecodedOp decode(uint16_t inst)
+    {
+        Chip8::DecodedOp op = Chip8::decode(inst);
+        op.handler = Chip8::handlerUnder(op.handler, Chip8::quirkTable[Chip8::QuirksModern]);
+        return op;
+    }
+    static void laneMasks(uint32_t bits, Mask8& m8, Words& m16, Dwords& m32);
+    void storeByte(int lane, uint16_t addr, uint8_t value);
+    bool drawSprite(int lane, uint8_t x, uint8_t y, uint8_t height);
+};
+
+extern template struct Lockstep<8>;
+extern template struct Lockstep<16>;
+extern template struct Lockstep<32>;
@@ -1,47 +1,167 @@
+#include <array>
+#include <atomic>
 #include <map>
+#include <vector>
+#include <cstring>
+#include <algorithm>
+
+#include "Chip8.h"
 
 class MyDisplay : public Fl_Window
 {
 private:
-    #define Width 64
-    #define Height 32
-    // 64x32 pixels
-    // std::array<uchar, Width*Height> pixels;
-    std::array<std::array<bool, Width>, Height> pixels;
+    // The last frame handed to present(), like Chip8::pixels
+    Chip8::Screen screen {};
+    bool hires = false;
     Fl_Color white, black;
-public:
-    MyDisplay(int w, int h, const char *l = 0) : Fl_Window(w, h, l){}
-    bool setPixel(int x, int y)
-    {
-        bool res = pixels[y][x];
-        pixels[y][x] = true;
-        return res&1;
-    }
-    bool unSetPixel(int x, int y)
+    // Screen scaled up to the window, one byte per pixel
+    std::vector<uchar> image;
+    int imageW = 0, imageH = 0;
+    // Rows changed since the last draw()
+    uint64_t pendingRows = 0;
+    // Keyboard keys for CHIP-8 keys 0 to F
+    static constexpr std::array<char, 16> keymap = {'x','1','2','3','q','w','e','a','s','d','z','c','4','r','f','v'};
+    // Bit n is set while CHIP-8 key n is held, kept up to date by handle()
+    std::atomic<uint16_t> keyMask {0};
+    std::atomic<bool> backspace {false};
+
+    // Size of the screen in the mode of the last frame
+    int width() const { return hires ? Chip8::ScreenWidth : Chip8::LowResWidth; }
+    int height() const { return hires ? Chip8::ScreenHeight : Chip8::LowResHeight; }
+
+    // Expand one screen row into scaleY identical lines of the image. Each
+    // pixel's bits from the XO-CHIP planes pick one of four grey levels.
+    void expandRow(int row, int scaleX, int scaleY)
     {
-        bool res = pixels[y][x];
-        pixels[y][x] = false;
-        return res&1;
+        static constexpr uchar levels[4] = {0x00, 0xff, 0x80, 0xc0};
+        uchar* line = &image[row * scaleY * imageW];
+        const Chip8::Row bits0 = screen[0][row];
+        const Chip8::Row bits1 = screen[1][row];
+        for (int p = 0; p < width(); p++)
+        {
+            const int shift = Chip8::ScreenWidth - 1 - p;
+            const int color = ((bits0 >> shift) & 1) | (((bits1 >> shift) & 1) << 1);
+            std::memset(line + p*scaleX, levels[color], scaleX);
+        }
+        for (int y = 1; y < scaleY; y++)
+        {
+            std::memcpy(line + y*imageW, line, imageW);
+        }
     }
-    bool flipPixel(int x, int y)
+public:
+    MyDisplay(int w, int h, const char *l = 0) : Fl_Window(w, h, l){}
+
+    // Keys held right now, sampled once per frame by the emulation thread
+    uint16_t keys() const { return keyMask.load(std::memory_order_relaxed); }
+    // Backspace is held
+    bool rewinding() const { return backspace.load(std::memory_order_relaxed); }
+
+    // Show a new frame, redrawing only the rows that differ from the last one
+    void present(const Chip8::Screen& pixels, bool highRes)
     {
-        bool res = pixels[y][x];
-        pixels[y][x] = !res;
-        return res&1;
+        uint64_t rows = 0;
+        for (int row = 0; row < Chip8::ScreenHeight; row++)
+        {
+            for (int plane = 0; plane < Chip8::Planes; plane++)
+            {
+                rows |= (uint64_t)(pixels[plane][row] != screen[plane][row]) << row;
+            }
+        }
+        if (highRes != hires)
+        {
+            // Every pixel changes size
+            hires = highRes;
+            imageW = 0;
+            rows = ~0ULL;
+        }
+        if (rows)
+        {
+            screen = pixels;
+            pendingRows |= rows;
+            damage(FL_DAMAGE_USER1);
+        }
     }
 protected:
-    void draw()
+    int handle(int event)
     {
-        int scaleX = this->w()/Width;
-        int scaleY = this->h()/Height;
-        // fl_draw_image_mono(pixels.data(), 0, 0, Width, Height, 1);
-        for (int row = 0; row < Height; row++)
+        switch (event)
         {
-            for (int p = 0; p < Width; p++)
+        case FL_FOCUS:
+            return 1;
+        case FL_UNFOCUS:
+            // Key releases are not seen without focus
+            keyMask = 0;
+            backspace = false;
+            return 1;
+        case FL_KEYDOWN:
+        case FL_KEYUP:
             {
-                fl_rectf(p*scaleX, row*scaleY, scaleX, scaleY, pixels[row][p] ? FL_WHITE : FL_BLACK);
+                const bool down = event == FL_KEYDOWN;
+                const int key = Fl::event_key();
+                if (key == FL_BackSpace)
+                {
+                    backspace = down;
+                    return 1;
+                }
+                auto mapped = std::find(keymap.begin(), keymap.end(), key);
+                if (mapped != keymap.end())
+                {
+                    const uint16_t bit = 1 << (mapped - keymap.begin());
+                    if (down)
+                    {
+                        keyMask.fetch_or(bit, std::memory_order_relaxed);
+                    }
+                    else
+                    {
+                        keyMask.fetch_and(~bit, std::memory_order_relaxed);
+                    }
+                    return 1;
+                }
             }
-            
+            break;
+        }
+        return Fl_Window::handle(event);
+    }
+
+    void draw()
+    {
+        int scaleX = this->w()/width();
+        int scaleY = this->h()/height();
+        if (scaleX < 1 || scaleY < 1)
+        {
+            return;
+        }
+        bool full = (damage() & FL_DAMAGE_ALL) != 0;
+        if (imageW != width()*scaleX || imageH != height()*scaleY)
+        {
+            imageW = width()*scaleX;
+            imageH = height()*scaleY;
+            image.assign(imageW * imageH, 0);
+            pendingRows = ~0ULL >> (64 - height());
+            full = true;
+        }
+        pendingRows &= ~0ULL >> (64 - height());
+        if (!full && !pendingRows)
+        {
+            return;
+        }
+
+        int first = height(), last = -1;
+        for (uint64_t rows = pendingRows; rows; rows &= rows - 1)
+        {
+            int row = __builtin_ctzll(rows);
+            expandRow(row, scaleX, scaleY);
+            first = std::min(first, row);
+            last = std::max(last, row);
+        }
+        pendingRows = 0;
+
+        // One blit covering the changed band, or everything after an expose
+        if (full)
+        {
+            first = 0;
+            last = height() - 1;
         }
+        fl_draw_image_mono(&image[first * scaleY * imageW], 0, first*scaleY, imageW, (last - first + 1)*scaleY, 1, imageW);
     }
-};
\ No newline at end of file
+};
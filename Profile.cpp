@@ -0,0 +1,111 @@
+#include "Profile.h"
+
+#include <algorithm>
+#include <cstdio>
+#include <ostream>
+#include <vector>
+
+const char* Profile::handlerName(uint8_t handler)
+{
+    // Must match Chip8::Handler
+    static const char* const names[] = {
+        "not decoded", "undefined", "00E0 clear", "00EE return", "1nnn jump", "2nnn call",
+        "3xnn skip eq", "4xnn skip neq", "5xy0 skip eq reg", "6xnn load", "7xnn add",
+        "8xy0 move", "8xy1 or", "8xy2 and", "8xy3 xor", "8xy4 add", "8xy5 sub", "8xy6 shift right",
+        "8xy7 sub reverse", "8xyE shift left", "9xy0 skip neq reg", "Annn load I", "Bnnn jump offset",
+        "Cxnn random", "Dxyn draw", "Ex9E skip key", "ExA1 skip not key", "Fx07 get delay", "Fx0A wait key",
+        "Fx15 set delay", "Fx18 set sound", "Fx1E add I", "Fx29 font", "Fx33 bcd", "Fx55 store", "Fx65 load",
+        "00FD exit", "00FE low res", "00FF high res", "00Cn scroll down", "00FB scroll right", "00FC scroll left",
+        "Dxy0 draw 16x16", "Fx30 big font", "Fx75 save flags", "Fx85 load flags",
+        "F000 long I", "Fn01 planes", "F002 audio", "Fx3A pitch", "5xy2 save range", "5xy3 load range",
+        "00Dn scroll up"
+    };
+    static_assert(sizeof(names)/sizeof(names[0]) == Chip8::OpCount);
+    return handler < Chip8::OpCount ? names[handler] : "?";
+}
+
+void Profile::report(std::ostream& out, const Chip8& m, size_t limit) const
+{
+    char line[128];
+    auto percent = [&](uint64_t count)
+    {
+        return instructions ? 100.0 * count / instructions : 0.0;
+    };
+
+    std::vector<uint8_t> families;
+    for (uint8_t h = 0; h < Chip8::OpCount; h++)
+    {
+        if (ops[h])
+        {
+            families.push_back(h);
+        }
+    }
+    std::stable_sort(families.begin(), families.end(), [&](uint8_t a, uint8_t b) { return ops[a] > ops[b]; });
+    out << "instructions: " << instructions << "\n";
+    out << "by family:\n";
+    for (size_t i = 0; i < families.size() && i < limit; i++)
+    {
+        std::snprintf(line, sizeof(line), "  %-20s %14llu %6.2f%%\n", handlerName(families[i]),
+            (unsigned long long)ops[families[i]], percent(ops[families[i]]));
+        out << line;
+    }
+
+    std::vector<uint16_t> hot;
+    for (uint32_t pc = 0; pc < Chip8::MemorySize; pc++)
+    {
+        if (pcs[pc])
+        {
+            hot.push_back(pc);
+        }
+    }
+    std::stable_sort(hot.begin(), hot.end(), [&](uint16_t a, uint16_t b) { return pcs[a] > pcs[b]; });
+    out << "hot spots:\n";
+    for (size_t i = 0; i < hot.size() && i < limit; i++)
+    {
+        uint16_t pc = hot[i];
+        uint16_t inst = ((uint16_t)m.memory[pc] << 8) | m.memory[(pc + 1) & (m.memorySize() - 1)];
+        std::snprintf(line, sizeof(line), "  %03x: %04x %-20s %14llu %6.2f%%\n", pc, inst,
+            handlerName(Chip8::decode(inst).handler), (unsigned long long)pcs[pc], percent(pcs[pc]));
+        out << line;
+    }
+
+    std::snprintf(line, sizeof(line), "delay timer waits: %llu instructions (%.2f%%)\n",
+        (unsigned long long)waitInstructions, percent(waitInstructions));
+    out << line;
+    std::snprintf(line, sizeof(line), "key waits: %llu cycles (%.2f%%)\n",
+        (unsigned long long)waitKeyCycles, percent(waitKeyCycles));
+    out << line;
+    std::snprintf(line, sizeof(line), "draws: %llu taking %.3f ms (%.0f ns each)\n", (unsigned long long)draws,
+        drawNanoseconds / 1e6, draws ? (double)drawNanoseconds / draws : 0.0);
+    out << line;
+}
+
+void Profile::writeJson(std::ostream& out) const
+{
+    out << "{\"instructions\":" << instructions << ",\"wait_instructions\":" << waitInstructions
+        << ",\"wait_key_cycles\":" << waitKeyCycles
+        << ",\"draws\":" << draws << ",\"draw_ns\":" << drawNanoseconds << ",\"families\":{";
+    bool first = true;
+    for (uint8_t h = 0; h < Chip8::OpCount; h++)
+    {
+        if (ops[h])
+        {
+            out << (first ? "" : ",") << "\"" << handlerName(h) << "\":" << ops[h];
+            first = false;
+        }
+    }
+    // Addresses as hex strings, only the ones that ran
+    out << "},\"pcs\":{";
+    first = true;
+    char addr[8];
+    for (uint32_t pc = 0; pc < Chip8::MemorySize; pc++)
+    {
+        if (pcs[pc])
+        {
+            std::snprintf(addr, sizeof(addr), "%03x", pc);
+            out << (first ? "" : ",") << "\"" << addr << "\":" << pcs[pc];
+            first = false;
+        }
+    }
+    out << "}}\n";
+}
@@ -0,0 +1,98 @@
+#pragma once
+
+#include <array>
+#include <chrono>
+#include <cstdint>
+#include <iosfwd>
+
+#include "Chip8.h"
+
+// Profiling policies for Chip8::execute(). The interpreter calls these hooks
+// around every instruction; each policy says at compile time whether it
+// wants them, so the plain interpreter is built without any of the calls.
+//   instruction()  before an instruction runs, m.addrptr is its address
+//   retire()       after it ran, before the PC moves past it
+//   delayRead()    Fx07 read the delay timer
+//   random()       Cxnn drew a random byte
+//   stall()        Fx0A found no new key and waits out the rest of the run,
+//                  the `cycles` after this one that it stands in for
+//   drawBegin/End  around the sprite drawing of Dxyn and Dxy0
+
+// Used by interpret(), compiles to nothing. The JIT and translated ROMs never
+// call the hooks and step() may run either, so profiled runs go through
+// Chip8::profile() or Chip8::trace(), which always interpret.
+struct NoProfile
+{
+    static constexpr bool enabled = false;
+    void instruction(const Chip8&, const Chip8::DecodedOp&) {}
+    void retire(const Chip8&) {}
+    void delayRead(uint8_t) {}
+    void random(uint8_t) {}
+    void stall(const Chip8&, uint64_t) {}
+    void drawBegin() {}
+    void drawEnd() {}
+};
+
+// Counts executions per instruction family and per address, instructions
+// spent polling the delay timer and host time spent drawing. Pass it to
+// Chip8::profile(); counts add up across calls.
+struct Profile
+{
+    static constexpr bool enabled = true;
+
+    // Indexed by Chip8::Handler
+    std::array<uint64_t, Chip8::OpCount> ops {};
+    // Indexed by address
+    std::array<uint64_t, Chip8::MemorySize> pcs {};
+    uint64_t instructions = 0;
+    // Instructions run between an Fx07 that saw the delay timer running and
+    // the next one that saw it expired, the usual busy wait for the timer
+    uint64_t waitInstructions = 0;
+    // Cycles an Fx0A waited out for a key without running, counted as that
+    // many more Fx0A so `instructions` adds up to Chip8::cycles
+    uint64_t waitKeyCycles = 0;
+    uint64_t draws = 0;
+    uint64_t drawNanoseconds = 0;
+
+    void instruction(const Chip8& m, const Chip8::DecodedOp& op)
+    {
+        // Counted as what they run as under the quirks
+        ops[Chip8::handlerUnder(op.handler, m.quirks())]++;
+        pcs[m.addrptr]++;
+        instructions++;
+        waitInstructions += waiting;
+    }
+    void retire(const Chip8&) {}
+    void delayRead(uint8_t value)
+    {
+        waiting = value != 0;
+    }
+    void random(uint8_t) {}
+    void stall(const Chip8& m, uint64_t cycles)
+    {
+        ops[Chip8::OpWaitKey] += cycles;
+        pcs[m.addrptr] += cycles;
+        instructions += cycles;
+        waitKeyCycles += cycles;
+    }
+    void drawBegin()
+    {
+        drawStart = std::chrono::steady_clock::now();
+    }
+    void drawEnd()
+    {
+        draws++;
+        drawNanoseconds += std::chrono::duration_cast<std::chrono::nanoseconds>(std::chrono::steady_clock::now() - drawStart).count();
+    }
+
+    // Families and addresses by execution count, the top `limit` of each.
+    // `m` is used to show the instruction at each hot address.
+    void report(std::ostream& out, const Chip8& m, size_t limit = 20) const;
+    void writeJson(std::ostream& out) const;
+
+    static const char* handlerName(uint8_t handler);
+
+private:
+    bool waiting = false;
+    std::chrono::steady_clock::time_point drawStart;
+};
@@ -0,0 +1,148 @@
+#include "Recording.h"
+
+#include <fstream>
+#include <iterator>
+
+namespace
+{
+    const char magic[4] = {'C', '8', 'R', 'P'};
+    const uint8_t version = 2;
+
+    void putLittle(std::string& out, uint64_t v, int bytes)
+    {
+        for (int i = 0; i < bytes; i++)
+        {
+            out += (char)(v >> (8 * i));
+        }
+    }
+
+    bool getLittle(const std::string& in, size_t& pos, uint64_t& v, int bytes)
+    {
+        if (pos + bytes > in.size())
+        {
+            return false;
+        }
+        v = 0;
+        for (int i = 0; i < bytes; i++)
+        {
+            v |= (uint64_t)(uint8_t)in[pos++] << (8 * i);
+        }
+        return true;
+    }
+
+    void putVarint(std::string& out, uint64_t v)
+    {
+        while (v >= 0x80)
+        {
+            out += (char)(v | 0x80);
+            v >>= 7;
+        }
+        out += (char)v;
+    }
+
+    bool getVarint(const std::string& in, size_t& pos, uint64_t& v)
+    {
+        v = 0;
+        for (int shift = 0; shift < 64; shift += 7)
+        {
+            if (pos >= in.size())
+            {
+                return false;
+            }
+            uint8_t b = in[pos++];
+            v |= (uint64_t)(b & 0x7f) << shift;
+            if (!(b & 0x80))
+            {
+                return true;
+            }
+        }
+        return false;
+    }
+}
+
+uint64_t Recording::programHash(const Chip8& m)
+{
+    // FNV-1a up to the end of the 4 KB machine, or further if the program
+    // does, so hashes of classic programs are the same as before XO-CHIP
+    size_t end = m.memorySize();
+    while (end > Chip8::ClassicMemorySize && m.memory[end - 1] == 0)
+    {
+        end--;
+    }
+    uint64_t h = 0xcbf29ce484222325;
+    for (size_t i = Chip8::ProgramStart; i < end; i++)
+    {
+        h = (h ^ m.memory[i]) * 0x100000001b3;
+    }
+    return h;
+}
+
+bool Recording::save(const std::string& filename) const
+{
+    std::string out(magic, sizeof(magic));
+    out += (char)version;
+    putLittle(out, seed, 4);
+    putLittle(out, instructionsPerFrame, 4);
+    putLittle(out, romHash, 8);
+    out += (char)quirks;
+    for (size_t i = 0; i < keys.size(); )
+    {
+        size_t run = 1;
+        while (i + run < keys.size() && keys[i + run] == keys[i])
+        {
+            run++;
+        }
+        putLittle(out, keys[i], 2);
+        putVarint(out, run);
+        i += run;
+    }
+
+    std::ofstream file(filename, std::ios::binary|std::ios::out|std::ios::trunc);
+    file.write(out.data(), out.size());
+    return (bool)file;
+}
+
+bool Recording::load(const std::string& filename, std::string& error)
+{
+    std::ifstream file(filename, std::ios::binary|std::ios::in);
+    if (!file)
+    {
+        error = "Could not open " + filename;
+        return false;
+    }
+    std::string in((std::istreambuf_iterator<char>(file)), std::istreambuf_iterator<char>());
+
+    size_t pos = sizeof(magic) + 1;
+    if (in.size() < pos || in.compare(0, sizeof(magic), magic, sizeof(magic)) != 0 || (uint8_t)in[sizeof(magic)] != version)
+    {
+        error = filename + " is not a recording";
+        return false;
+    }
+    uint64_t seedValue, frameLength;
+    if (!getLittle(in, pos, seedValue, 4) || !getLittle(in, pos, frameLength, 4) || !getLittle(in, pos, romHash, 8))
+    {
+        error = filename + " is truncated";
+        return false;
+    }
+    seed = seedValue;
+    instructionsPerFrame = frameLength;
+    if (pos >= in.size() || (uint8_t)in[pos] >= Chip8::QuirkProfileCount)
+    {
+        error = filename + " has an unknown quirk profile";
+        return false;
+    }
+    quirks = (Chip8::QuirkProfile)(uint8_t)in[pos++];
+
+    keys.clear();
+    while (pos < in.size())
+    {
+        uint64_t mask, run;
+        if (!getLittle(in, pos, mask, 2) || !getVarint(in, pos, run) || run > (1u << 30))
+        {
+            error = filename + " is truncated";
+            return false;
+        }
+        keys.insert(keys.end(), run, mask);
+    }
+    return true;
+}
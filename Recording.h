@@ -0,0 +1,33 @@
+#pragma once
+
+#include <cstdint>
+#include <string>
+#include <vector>
+
+#include "Chip8.h"
+
+// Everything that is not deterministic about a run: the RNG seed and the
+// keys held during each 60 Hz frame. Replaying it through runFrame() with the
+// same ROM and frame length reproduces the session exactly.
+//
+// On disk: "C8RP", version byte, seed, instructions per frame, program hash
+// (little endian) and quirk profile byte, then the key masks as runs of
+// <16-bit mask> <varint repeat count>. Keys rarely change between frames,
+// so a minute of play is typically a few hundred bytes.
+struct Recording
+{
+    uint32_t seed = 1;
+    uint32_t instructionsPerFrame = 11;
+    // programHash() of the machine the session was recorded on
+    uint64_t romHash = 0;
+    Chip8::QuirkProfile quirks = Chip8::QuirksModern;
+    // One key mask per frame
+    std::vector<uint16_t> keys;
+
+    bool save(const std::string& filename) const;
+    // Returns false and sets `error` if the file is missing or malformed
+    bool load(const std::string& filename, std::string& error);
+
+    // Hash of memory from 0x200 up, taken right after loading the ROM
+    static uint64_t programHash(const Chip8& m);
+};
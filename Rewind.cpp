@@ -0,0 +1,313 @@
+#include "Rewind.h"
+
+#include <algorithm>
+#include <cstring>
+
+namespace
+{
+    void putVarint(std::vector<uint8_t>& out, size_t v)
+    {
+        while (v >= 0x80)
+        {
+            out.push_back(v | 0x80);
+            v >>= 7;
+        }
+        out.push_back(v);
+    }
+
+    size_t getVarint(const uint8_t*& p)
+    {
+        size_t v = 0;
+        for (int shift = 0; ; shift += 7)
+        {
+            uint8_t b = *p++;
+            v |= (size_t)(b & 0x7f) << shift;
+            if (!(b & 0x80))
+            {
+                return v;
+            }
+        }
+    }
+}
+
+Rewind::Rewind(size_t capacity) : ring(capacity)
+{
+    clear();
+}
+
+void Rewind::clear()
+{
+    deltas.clear();
+    head = 0;
+    used = 0;
+    captured = false;
+    // Also zeroes the padding, which is then never written and always matches
+    last = Image{};
+    next = Image{};
+}
+
+void Rewind::save(const Chip8& m, Image& image)
+{
+    image.pixels = m.pixels;
+    image.stack = m.stack;
+    image.regs = m.regs;
+    image.userFlags = m.userFlags;
+    image.audioPattern = m.audioPattern;
+    image.cycles = m.cycles;
+    image.rngState = m.rngState;
+    image.addrptr = m.addrptr;
+    image.memptr = m.memptr;
+    image.keys = m.keys;
+    image.lastKeys = m.lastKeys;
+    image.delay = m.delay;
+    image.sound = m.sound;
+    image.sp = m.sp;
+    image.done = m.done;
+    image.exitReason = m.exitReason;
+    image.hires = m.hires;
+    image.planeMask = m.planeMask;
+    image.pitch = m.pitch;
+    image.patternLoaded = m.patternLoaded;
+    image.waitingForKey = m.waitingForKey;
+}
+
+void Rewind::restore(const Image& image, const Chip8::PageSet& pages, Chip8& m)
+{
+    // Only copy, and drop the decoded code of, the pages that differ
+    const size_t count = m.memorySize() / Chip8::PageSize;
+    for (size_t page = 0; page < count; page++)
+    {
+        if (!((pages[page / 64] >> (page % 64)) & 1))
+        {
+            continue;
+        }
+        const size_t at = page * Chip8::PageSize;
+        if (std::memcmp(&m.memory[at], &image.memory[at], Chip8::PageSize) != 0)
+        {
+            std::memcpy(&m.memory[at], &image.memory[at], Chip8::PageSize);
+            m.invalidateCode(at, Chip8::PageSize);
+        }
+    }
+    for (int r = 0; r < Chip8::ScreenHeight; r++)
+    {
+        for (int p = 0; p < Chip8::Planes; p++)
+        {
+            if (m.pixels[p][r] != image.pixels[p][r] || m.hires != image.hires)
+            {
+                m.dirtyRows |= 1ULL << r;
+            }
+        }
+    }
+    m.pixels = image.pixels;
+    m.stack = image.stack;
+    m.regs = image.regs;
+    m.userFlags = image.userFlags;
+    m.audioPattern = image.audioPattern;
+    m.cycles = image.cycles;
+    m.rngState = image.rngState;
+    m.addrptr = image.addrptr;
+    m.memptr = image.memptr;
+    m.keys = image.keys;
+    m.lastKeys = image.lastKeys;
+    m.delay = image.delay;
+    m.sound = image.sound;
+    m.sp = image.sp;
+    m.done = image.done;
+    m.exitReason = image.exitReason;
+    m.hires = image.hires;
+    m.planeMask = image.planeMask;
+    m.pitch = image.pitch;
+    m.patternLoaded = image.patternLoaded;
+    m.waitingForKey = image.waitingForKey;
+}
+
+void Rewind::capture(Chip8& m)
+{
+    // Memory comes first in the image, at the same offsets as in m
+    static_assert(offsetof(Image, memory) == 0);
+    const size_t rest = offsetof(Image, pixels);
+    save(m, next);
+    if (!captured)
+    {
+        std::copy(m.memory, m.memory + m.memorySize(), last.memory.begin());
+        std::memcpy((uint8_t*)&last + rest, (const uint8_t*)&next + rest, sizeof(Image) - rest);
+        m.dirtyPages.fill(0);
+        captured = true;
+        return;
+    }
+
+    // Encode the new state ^ last as runs of <unchanged bytes> <changed
+    // bytes> <XOR of the changed bytes>. The XOR works in both directions,
+    // applying it to the new state gives back the old one.
+    scratch.clear();
+    size_t pos = 0;
+    size_t page = 0;
+    const size_t count = m.memorySize() / Chip8::PageSize;
+    while (page < count)
+    {
+        if (!m.dirtyPages[page / 64])
+        {
+            page += 64;
+            continue;
+        }
+        if (!m.pageDirty(page))
+        {
+            page++;
+            continue;
+        }
+        // Neighbouring written pages go in one piece
+        size_t end = page + 1;
+        while (end < count && m.pageDirty(end))
+        {
+            end++;
+        }
+        const size_t from = page * Chip8::PageSize, to = end * Chip8::PageSize;
+        encode(m.memory, last.memory.data(), from, to, pos);
+        std::memcpy(&last.memory[from], &m.memory[from], to - from);
+        page = end;
+    }
+    m.dirtyPages.fill(0);
+    encode((const uint8_t*)&next, (const uint8_t*)&last, rest, sizeof(Image), pos);
+    std::memcpy((uint8_t*)&last + rest, (const uint8_t*)&next + rest, sizeof(Image) - rest);
+    putVarint(scratch, sizeof(Image) - pos);
+    store(scratch);
+}
+
+void Rewind::encode(const uint8_t* a, const uint8_t* b, size_t from, size_t to, size_t& pos)
+{
+    size_t i = from;
+    while (i < to)
+    {
+        // Skip unchanged bytes a word at a time, memory is mostly unchanged
+        while (i + 8 <= to && std::memcmp(a + i, b + i, 8) == 0)
+        {
+            i += 8;
+        }
+        while (i < to && a[i] == b[i])
+        {
+            i++;
+        }
+        if (i == to)
+        {
+            return;
+        }
+        putVarint(scratch, i - pos);
+
+        // Gaps of up to two unchanged bytes are cheaper to keep in the run
+        // than to start a new one
+        size_t run = i;
+        while (i < to)
+        {
+            if (a[i] != b[i])
+            {
+                i++;
+            }
+            else if (i + 1 < to && a[i + 1] != b[i + 1])
+            {
+                i += 2;
+            }
+            else if (i + 2 < to && a[i + 2] != b[i + 2])
+            {
+                i += 3;
+            }
+            else
+            {
+                break;
+            }
+        }
+        putVarint(scratch, i - run);
+        for (size_t k = run; k < i; k++)
+        {
+            scratch.push_back(a[k] ^ b[k]);
+        }
+        pos = i;
+    }
+}
+
+void Rewind::store(const std::vector<uint8_t>& delta)
+{
+    if (delta.size() > ring.size())
+    {
+        // Cannot be kept, and the older ones no longer lead back from here
+        deltas.clear();
+        head = 0;
+        used = 0;
+        return;
+    }
+    if (head + delta.size() > ring.size())
+    {
+        // Does not fit before the end: everything still after head is the
+        // oldest history, drop it and continue from the start
+        while (!deltas.empty() && deltas.front().offset >= head)
+        {
+            used -= deltas.front().size;
+            deltas.pop_front();
+        }
+        head = 0;
+    }
+    // Drop the oldest snapshots this one overwrites
+    while (!deltas.empty() && deltas.front().offset >= head && deltas.front().offset < head + delta.size())
+    {
+        used -= deltas.front().size;
+        deltas.pop_front();
+    }
+    std::copy(delta.begin(), delta.end(), ring.begin() + head);
+    deltas.push_back({head, delta.size()});
+    head += delta.size();
+    used += delta.size();
+}
+
+void Rewind::apply(const uint8_t* delta, Image& image, Chip8::PageSet& pages)
+{
+    uint8_t* out = (uint8_t*)&image;
+    const size_t size = sizeof(Image);
+    size_t pos = 0;
+    while (true)
+    {
+        pos += getVarint(delta);
+        if (pos >= size)
+        {
+            return;
+        }
+        size_t len = getVarint(delta);
+        for (size_t i = 0; i < len; i++)
+        {
+            out[pos + i] ^= delta[i];
+        }
+        // Runs never cross from memory into the rest
+        if (pos < Chip8::MemorySize)
+        {
+            for (size_t page = pos / Chip8::PageSize; page <= (pos + len - 1) / Chip8::PageSize; page++)
+            {
+                pages[page / 64] |= 1ULL << (page % 64);
+            }
+        }
+        delta += len;
+        pos += len;
+    }
+}
+
+size_t Rewind::rewind(Chip8& m, size_t frames)
+{
+    if (!captured)
+    {
+        return 0;
+    }
+    // Memory differs from `last` where m wrote since the capture and where
+    // the deltas change it
+    Chip8::PageSet pages = m.dirtyPages;
+    size_t stepped = 0;
+    while (stepped < frames && !deltas.empty())
+    {
+        const Delta d = deltas.back();
+        deltas.pop_back();
+        apply(&ring[d.offset], last, pages);
+        // The next capture reuses the space
+        head = d.offset;
+        used -= d.size;
+        stepped++;
+    }
+    restore(last, pages, m);
+    m.dirtyPages.fill(0);
+    return stepped;
+}
@@ -0,0 +1,95 @@
+#pragma once
+
+#include <array>
+#include <cstdint>
+#include <cstddef>
+#include <deque>
+#include <vector>
+
+#include "Chip8.h"
+
+// History of machine states for stepping back in time. capture() is called
+// once per frame; each snapshot is stored as the XOR of the machine state with
+// the previous snapshot, run-length encoded, in a fixed size ring. Most
+// frames only touch a few registers and screen rows, so they take tens of
+// bytes and an hour of play fits in a few MB. The oldest snapshots are
+// dropped when the ring is full.
+//
+// Of memory only the pages in Chip8::dirtyPages are compared and copied, so
+// capturing and rewinding cost as much as the program wrote, not 64 KB.
+// Both clear dirtyPages; use one Rewind per machine.
+class Rewind
+{
+public:
+    explicit Rewind(size_t capacity = 8 << 20);
+
+    // Record the current state of m
+    void capture(Chip8& m);
+    // Go back `frames` snapshots, forgetting the newer ones, and load that
+    // state into m. 0 reloads the last capture. Returns how many snapshots
+    // were actually stepped back, which is less at the start of the history.
+    size_t rewind(Chip8& m, size_t frames = 1);
+    // Snapshots before the last capture that can be rewound to
+    size_t frames() const { return deltas.size(); }
+    // Bytes of the ring in use
+    size_t bytes() const { return used; }
+    void clear();
+
+private:
+    // Everything rewind restores, as one flat block of bytes
+    struct Image
+    {
+        std::array<uint8_t, Chip8::MemorySize> memory;
+        Chip8::Screen pixels;
+        std::array<uint16_t, Chip8::StackDepth> stack;
+        std::array<uint8_t, 16> regs;
+        std::array<uint8_t, 16> userFlags;
+        std::array<uint8_t, 16> audioPattern;
+        uint64_t cycles;
+        uint32_t rngState;
+        uint16_t addrptr;
+        uint16_t memptr;
+        uint16_t keys;
+        uint16_t lastKeys;
+        uint8_t delay;
+        uint8_t sound;
+        uint8_t sp;
+        uint8_t done;
+        uint8_t exitReason;
+        uint8_t hires;
+        uint8_t planeMask;
+        uint8_t pitch;
+        uint8_t patternLoaded;
+        uint8_t waitingForKey;
+    };
+
+    // Where one encoded delta lives in the ring
+    struct Delta
+    {
+        size_t offset;
+        size_t size;
+    };
+
+    std::vector<uint8_t> ring;
+    // Oldest first
+    std::deque<Delta> deltas;
+    size_t head;
+    size_t used;
+    bool captured;
+    // State at the last capture, the deltas lead back from here
+    Image last;
+    Image next;
+    std::vector<uint8_t> scratch;
+
+    // Everything but memory
+    static void save(const Chip8& m, Image& image);
+    // Everything, memory only where it is in `pages`
+    static void restore(const Image& image, const Chip8::PageSet& pages, Chip8& m);
+    // Append runs for the bytes of [from, to) that differ between a and b,
+    // `pos` is where the previous run ended
+    void encode(const uint8_t* a, const uint8_t* b, size_t from, size_t to, size_t& pos);
+    // XOR an encoded delta into `image`, adding the memory pages it changes
+    // to `pages`
+    static void apply(const uint8_t* delta, Image& image, Chip8::PageSet& pages);
+    void store(const std::vector<uint8_t>& delta);
+};
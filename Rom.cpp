@@ -0,0 +1,328 @@
+#include "Rom.h"
+
+#include <algorithm>
+#include <cstdio>
+#include <cstring>
+#include <functional>
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <thread>
+#include <unistd.h>
+
+namespace
+{
+    const char magic[4] = {'C', '8', 'R', 'I'};
+    const uint32_t version = 4;
+    // The largest ROM any profile loads, Chip8::load() checks the current one
+    const size_t maxFileSize = Chip8::maxRomSize(Chip8::QuirksXoChip);
+
+    std::string hexName(uint64_t hash)
+    {
+        char name[17];
+        std::snprintf(name, sizeof(name), "%016llx", (unsigned long long)hash);
+        return name;
+    }
+}
+
+RomFile::RomFile() : bytes(nullptr), length(0), mapped(nullptr)
+{
+}
+
+RomFile::~RomFile()
+{
+    if (mapped)
+    {
+        munmap(mapped, length);
+    }
+}
+
+bool RomFile::open(const std::string& filename, std::string& error)
+{
+    int fd = ::open(filename.c_str(), O_RDONLY);
+    if (fd < 0)
+    {
+        error = "Could not open " + filename;
+        return false;
+    }
+    struct stat st;
+    if (fstat(fd, &st) == 0 && S_ISREG(st.st_mode) && st.st_size > 0 && (size_t)st.st_size <= maxFileSize)
+    {
+        void* p = mmap(nullptr, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+        if (p != MAP_FAILED)
+        {
+            mapped = p;
+            bytes = static_cast<const uint8_t*>(p);
+            length = st.st_size;
+        }
+    }
+    if (!mapped)
+    {
+        // Pipes and the like, or files that turned out too big: one byte
+        // past the limit is enough to tell
+        copy.resize(maxFileSize + 1);
+        size_t got = 0;
+        ssize_t n;
+        while (got < copy.size() && (n = ::read(fd, copy.data() + got, copy.size() - got)) > 0)
+        {
+            got += n;
+        }
+        copy.resize(got);
+        bytes = copy.data();
+        length = got;
+    }
+    ::close(fd);
+
+    if (length == 0)
+    {
+        error = filename + " is empty";
+        return false;
+    }
+    if (length > maxFileSize)
+    {
+        error = filename + " does not fit in memory, at most " + std::to_string(maxFileSize) + " bytes";
+        return false;
+    }
+    return true;
+}
+
+uint64_t romHash(const uint8_t* data, size_t size)
+{
+    uint64_t h = 0xcbf29ce484222325;
+    for (size_t i = 0; i < size; i++)
+    {
+        h = (h ^ data[i]) * 0x100000001b3;
+    }
+    return h;
+}
+
+void RomImage::build(const uint8_t* rom, size_t romSize)
+{
+    std::memset(this, 0, sizeof(*this));
+    std::memcpy(magic, ::magic, sizeof(magic));
+    version = ::version;
+    hash = romHash(rom, romSize);
+    size = romSize;
+
+    std::copy(Chip8::font, Chip8::font + 80, memory.begin());
+    std::copy(Chip8::bigFont, Chip8::bigFont + 160, memory.begin() + Chip8::BigFontStart);
+    std::memcpy(&memory[Chip8::ProgramStart], rom, romSize);
+    for (size_t a = 0; a < Chip8::ClassicMemorySize; a++)
+    {
+        if (a < Chip8::ClassicMemorySize - 1)
+        {
+            decoded[a] = Chip8::decode(((uint16_t)memory[a] << 8) | memory[a + 1]);
+        }
+        else
+        {
+            decoded[a].handler = Chip8::OpNotDecoded;
+        }
+    }
+
+    // Follow every path from 0x200 to mark the code
+    std::vector<uint16_t> pending = {Chip8::ProgramStart};
+    flags[Chip8::ProgramStart] |= Target;
+    while (!pending.empty())
+    {
+        uint32_t pc = pending.back();
+        pending.pop_back();
+        auto branch = [&](uint32_t target)
+        {
+            flags[target] |= Target;
+            pending.push_back(target);
+        };
+        bool falls = true;
+        while (falls && pc < Chip8::ClassicMemorySize - 1 && !(flags[pc] & Code))
+        {
+            flags[pc] |= Code;
+            const Chip8::DecodedOp& op = decoded[pc];
+            switch (op.handler)
+            {
+            case Chip8::OpJump:
+                branch(op.nnn);
+                falls = false;
+                break;
+            case Chip8::OpCall:
+                branch(op.nnn);
+                break;
+            case Chip8::OpReturn:
+            case Chip8::OpExit:
+                falls = false;
+                break;
+            case Chip8::OpJumpOffset:
+                flags[pc] |= Indirect;
+                falls = false;
+                break;
+            case Chip8::OpSkipEqImm:
+            case Chip8::OpSkipNeqImm:
+            case Chip8::OpSkipEqReg:
+            case Chip8::OpSkipNeqReg:
+            case Chip8::OpSkipKey:
+            case Chip8::OpSkipNotKey:
+                if (pc + 4 < Chip8::ClassicMemorySize)
+                {
+                    branch(pc + 4);
+                }
+                // XO-CHIP skips all of an F000 nnnn
+                if (pc + 6 < Chip8::ClassicMemorySize && decoded[pc + 2].handler == Chip8::OpLongI)
+                {
+                    branch(pc + 6);
+                }
+                break;
+            case Chip8::OpLongI:
+                // The address that follows is data
+                pc += 2;
+                break;
+            default:
+                break;
+            }
+            pc += 2;
+        }
+    }
+}
+
+void RomImage::apply(Chip8& m) const
+{
+    // Under XO-CHIP the memory above stays as reset() left it, zero and not
+    // decoded yet
+    m.reset();
+    std::copy(memory.begin(), memory.end(), m.memory);
+    std::copy(decoded.begin(), decoded.end(), m.decoded);
+}
+
+RomCache::RomCache(const std::string& dir) : directory(dir)
+{
+}
+
+RomCache::~RomCache()
+{
+    for (auto&& entry : images)
+    {
+        munmap(const_cast<RomImage*>(entry.second), sizeof(RomImage));
+    }
+    for (const RomImage* image : owned)
+    {
+        delete image;
+    }
+}
+
+const RomImage* RomCache::image(const std::string& filename, std::string& error)
+{
+    RomFile rom;
+    if (!rom.open(filename, error))
+    {
+        return nullptr;
+    }
+    if (rom.size() > RomImage::MaxRomSize)
+    {
+        error = filename + " does not fit in a ROM image, at most " + std::to_string(RomImage::MaxRomSize) + " bytes";
+        return nullptr;
+    }
+    return image(rom);
+}
+
+const RomImage* RomCache::image(const RomFile& rom)
+{
+    const uint64_t hash = romHash(rom.data(), rom.size());
+
+    std::lock_guard<std::mutex> guard(lock);
+    auto known = images.find(hash);
+    if (known != images.end())
+    {
+        return known->second;
+    }
+    for (const RomImage* image : owned)
+    {
+        if (image->hash == hash)
+        {
+            return image;
+        }
+    }
+
+    const std::string path = directory + "/" + hexName(hash) + ".c8i";
+    if (const RomImage* image = map(path, hash, rom))
+    {
+        return images[hash] = image;
+    }
+    // Not cached yet, or a stale or damaged entry
+    RomImage* built = new RomImage;
+    built->build(rom.data(), rom.size());
+    store(path, *built);
+    if (const RomImage* image = map(path, hash, rom))
+    {
+        delete built;
+        return images[hash] = image;
+    }
+    // The directory is not writable, keep it in memory
+    owned.push_back(built);
+    return built;
+}
+
+bool RomCache::load(const std::string& filename, Chip8& m, std::string& error)
+{
+    RomFile rom;
+    if (!rom.open(filename, error))
+    {
+        return false;
+    }
+    if (rom.size() > Chip8::maxRomSize(m.quirkProfile))
+    {
+        error = filename + " does not fit in memory under " + Chip8::quirkName(m.quirkProfile);
+        return false;
+    }
+    if (rom.size() > RomImage::MaxRomSize)
+    {
+        // Only XO-CHIP programs, decoded as they run
+        m.reset();
+        return m.load(rom.data(), rom.size());
+    }
+    image(rom)->apply(m);
+    return true;
+}
+
+const RomImage* RomCache::map(const std::string& path, uint64_t hash, const RomFile& rom)
+{
+    int fd = ::open(path.c_str(), O_RDONLY);
+    if (fd < 0)
+    {
+        return nullptr;
+    }
+    struct stat st;
+    void* p = MAP_FAILED;
+    if (fstat(fd, &st) == 0 && (size_t)st.st_size == sizeof(RomImage))
+    {
+        p = mmap(nullptr, sizeof(RomImage), PROT_READ, MAP_SHARED, fd, 0);
+    }
+    ::close(fd);
+    if (p == MAP_FAILED)
+    {
+        return nullptr;
+    }
+    const RomImage* image = static_cast<const RomImage*>(p);
+    // Also compare the bytes, so a hash collision can not load the wrong ROM
+    if (std::memcmp(image->magic, magic, sizeof(magic)) != 0 || image->version != version || image->hash != hash
+        || image->size != rom.size() || std::memcmp(&image->memory[Chip8::ProgramStart], rom.data(), rom.size()) != 0)
+    {
+        munmap(p, sizeof(RomImage));
+        return nullptr;
+    }
+    return image;
+}
+
+void RomCache::store(const std::string& path, const RomImage& image)
+{
+    // Readers only ever see complete entries
+    std::string temporary = path + "." + std::to_string(getpid()) + "." +
+        std::to_string(std::hash<std::thread::id>()(std::this_thread::get_id())) + ".tmp";
+    std::FILE* out = std::fopen(temporary.c_str(), "wb");
+    if (!out)
+    {
+        return;
+    }
+    bool ok = std::fwrite(&image, sizeof(image), 1, out) == 1;
+    ok = std::fclose(out) == 0 && ok;
+    if (!ok || std::rename(temporary.c_str(), path.c_str()) != 0)
+    {
+        std::remove(temporary.c_str());
+    }
+}
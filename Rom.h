@@ -0,0 +1,105 @@
+#pragma once
+
+#include <array>
+#include <cstdint>
+#include <cstddef>
+#include <map>
+#include <mutex>
+#include <string>
+#include <vector>
+
+#include "Chip8.h"
+
+// A ROM file mapped read-only, or read in one go where it can not be mapped.
+// Rejects empty files and files that do not fit above 0x200.
+class RomFile
+{
+public:
+    RomFile();
+    ~RomFile();
+    RomFile(const RomFile&) = delete;
+    RomFile& operator=(const RomFile&) = delete;
+
+    bool open(const std::string& filename, std::string& error);
+    const uint8_t* data() const { return bytes; }
+    size_t size() const { return length; }
+
+private:
+    const uint8_t* bytes;
+    size_t length;
+    // Set when `bytes` is a mapping
+    void* mapped;
+    std::vector<uint8_t> copy;
+};
+
+// FNV-1a of the ROM bytes, the key of the cache
+uint64_t romHash(const uint8_t* data, size_t size);
+
+// A ROM loaded and analysed once, stored on disk exactly like this so the
+// file can be mapped and used in place. Covers the 4 KB machine: every
+// classic program and XO-CHIP programs of up to MaxRomSize bytes, which
+// get the rest of their memory from reset().
+struct RomImage
+{
+    static constexpr size_t MaxRomSize = Chip8::ClassicMemorySize - Chip8::ProgramStart;
+
+    // RomImage::flags
+    enum : uint8_t
+    {
+        // An instruction reachable from 0x200 starts here
+        Code = 1,
+        // Something jumps, calls or skips to here
+        Target = 2,
+        // A Bnnn here goes somewhere the analysis can not follow
+        Indirect = 4,
+    };
+
+    char magic[4];
+    uint32_t version;
+    uint64_t hash;
+    uint32_t size;
+    uint32_t reserved;
+    // Memory right after reset() and load()
+    std::array<uint8_t, Chip8::ClassicMemorySize> memory;
+    // Code/data map, everything not marked Code is treated as data
+    std::array<uint8_t, Chip8::ClassicMemorySize> flags;
+    // Chip8::decoded for that memory
+    std::array<Chip8::DecodedOp, Chip8::ClassicMemorySize> decoded;
+
+    // Fill everything in for a ROM
+    void build(const uint8_t* rom, size_t romSize);
+    // Reset m and load the image, decode cache included
+    void apply(Chip8& m) const;
+};
+
+// On-disk cache of RomImages in one directory, named by the content hash.
+// Entries are written once through a temporary file and a rename, and mapped
+// read-only afterwards, so any number of threads and processes can share a
+// directory. Safe to use from several threads.
+class RomCache
+{
+public:
+    explicit RomCache(const std::string& directory);
+    ~RomCache();
+    RomCache(const RomCache&) = delete;
+    RomCache& operator=(const RomCache&) = delete;
+
+    // The image for a ROM file, built and stored on first use. Stays valid
+    // until the cache is destroyed. Returns nullptr and sets `error` if the
+    // ROM can not be read or is larger than RomImage::MaxRomSize.
+    const RomImage* image(const std::string& filename, std::string& error);
+    // Reset m and load a ROM file through the cache, or directly if it is
+    // too large for an image
+    bool load(const std::string& filename, Chip8& m, std::string& error);
+
+private:
+    std::string directory;
+    std::mutex lock;
+    // Mapped entries, or heap copies where the directory can not be written
+    std::map<uint64_t, const RomImage*> images;
+    std::vector<const RomImage*> owned;
+
+    const RomImage* image(const RomFile& rom);
+    const RomImage* map(const std::string& path, uint64_t hash, const RomFile& rom);
+    void store(const std::string& path, const RomImage& image);
+};
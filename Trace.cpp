@@ -0,0 +1,341 @@
+#include "Trace.h"
+
+#include <algorithm>
+#include <chrono>
+#include <cstring>
+#include <iomanip>
+#include <ostream>
+#include <sstream>
+
+namespace
+{
+    const char magic[4] = {'C', '8', 'T', 'R'};
+    const uint16_t version = 1;
+}
+
+Tracer::Tracer(size_t capacity)
+{
+    size_t size = 1;
+    while (size < capacity)
+    {
+        size <<= 1;
+    }
+    ring.resize(size);
+    mask = size - 1;
+}
+
+Tracer::~Tracer()
+{
+    close();
+}
+
+bool Tracer::stream(const std::string& filename)
+{
+    if (streaming)
+    {
+        return false;
+    }
+    file = std::fopen(filename.c_str(), "wb");
+    if (!file)
+    {
+        return false;
+    }
+    writeHeader(file);
+    // Only records from now on go to the file
+    tail.store(produced, std::memory_order_relaxed);
+    tailSeen = produced;
+    stopping = false;
+    writeFailed = false;
+    streaming = true;
+    writer = std::thread(&Tracer::drain, this);
+    return true;
+}
+
+bool Tracer::close()
+{
+    if (!streaming)
+    {
+        return true;
+    }
+    stopping.store(true, std::memory_order_release);
+    writer.join();
+    streaming = false;
+    writeFailed |= std::fclose(file) != 0;
+    file = nullptr;
+    return !writeFailed;
+}
+
+// Runs on the writer thread until close()
+void Tracer::drain()
+{
+    uint64_t read = tail.load(std::memory_order_relaxed);
+    while (true)
+    {
+        // Check before looking at head so nothing pushed before close() is missed
+        bool last = stopping.load(std::memory_order_acquire);
+        uint64_t available = head.load(std::memory_order_acquire);
+        if (available == read)
+        {
+            if (last)
+            {
+                break;
+            }
+            std::this_thread::sleep_for(std::chrono::milliseconds(1));
+            continue;
+        }
+        // Up to the end of the ring, the rest on the next pass
+        size_t start = read & mask;
+        size_t count = std::min<uint64_t>(available - read, ring.size() - start);
+        if (std::fwrite(&ring[start], sizeof(TraceRecord), count, file) != count)
+        {
+            writeFailed = true;
+        }
+        read += count;
+        tail.store(read, std::memory_order_release);
+    }
+}
+
+std::vector<TraceRecord> Tracer::records() const
+{
+    uint64_t count = std::min<uint64_t>(produced, ring.size());
+    std::vector<TraceRecord> out;
+    out.reserve(count);
+    for (uint64_t i = produced - count; i < produced; i++)
+    {
+        out.push_back(ring[i & mask]);
+    }
+    return out;
+}
+
+bool Tracer::save(const std::string& filename) const
+{
+    std::FILE* out = std::fopen(filename.c_str(), "wb");
+    if (!out)
+    {
+        return false;
+    }
+    writeHeader(out);
+    std::vector<TraceRecord> kept = records();
+    bool ok = std::fwrite(kept.data(), sizeof(TraceRecord), kept.size(), out) == kept.size();
+    return std::fclose(out) == 0 && ok;
+}
+
+void Tracer::writeHeader(std::FILE* out)
+{
+    uint8_t header[8];
+    std::memcpy(header, magic, 4);
+    header[4] = version & 0xff;
+    header[5] = version >> 8;
+    header[6] = sizeof(TraceRecord);
+    header[7] = 0;
+    std::fwrite(header, 1, sizeof(header), out);
+}
+
+bool Tracer::readHeader(std::FILE* in, std::string& error)
+{
+    uint8_t header[8];
+    if (std::fread(header, 1, sizeof(header), in) != sizeof(header) || std::memcmp(header, magic, 4) != 0)
+    {
+        error = "not a trace file";
+        return false;
+    }
+    if ((header[4] | header[5] << 8) != version || header[6] != sizeof(TraceRecord))
+    {
+        error = "unsupported trace version";
+        return false;
+    }
+    return true;
+}
+
+// Must produce exactly what the DEBUG messages in Chip8::execute() print
+void Tracer::describe(const TraceRecord& r, std::ostream& out)
+{
+    Chip8::DecodedOp op = Chip8::decode(r.opcode);
+    unsigned int x = op.x, y = op.y;
+    // Registers as the DEBUG build sees them after the instruction
+    unsigned int xAfter = r.result;
+    unsigned int yAfter = y == x ? r.result : y == 0xf ? r.vf : r.vy;
+    unsigned int vx = r.vx, vy = r.vy;
+
+    std::ostringstream s;
+    s << std::hex;
+    if (r.flags & FlagUndefined)
+    {
+        op.handler = Chip8::OpUndefined;
+    }
+    else if (r.flags & FlagNoRows)
+    {
+        op.handler = Chip8::OpDraw;
+    }
+    switch (op.handler)
+    {
+    case Chip8::OpUndefined:
+        s << "undefined instruction";
+        break;
+    case Chip8::OpClear:
+        s << "clear";
+        break;
+    case Chip8::OpReturn:
+        s << "return to 0x" << r.next;
+        break;
+    case Chip8::OpJump:
+        s << "jump to 0x" << op.nnn;
+        break;
+    case Chip8::OpCall:
+        // A stack overflow stops before the message
+        if (!(r.flags & FlagStopped))
+        {
+            s << "call to 0x" << op.nnn;
+        }
+        break;
+    case Chip8::OpSkipEqImm:
+        s << "if r" << x << "(0x" << vx << ") == 0x" << (unsigned int)op.nn << " then skip";
+        break;
+    case Chip8::OpSkipNeqImm:
+        s << "if r" << x << "(0x" << vx << ") != 0x" << (unsigned int)op.nn << " then skip";
+        break;
+    case Chip8::OpSkipEqReg:
+        s << "if r" << x << "(0x" << vx << ") == r" << y << "(0x" << vy << ") then skip";
+        break;
+    case Chip8::OpLoadImm:
+        s << "assign r" << x << " the value 0x" << (unsigned int)op.nn;
+        break;
+    case Chip8::OpAddImm:
+        s << "increment r" << x << "(" << vx << ") by " << (unsigned int)op.nn << " = " << xAfter;
+        break;
+    case Chip8::OpMove:
+        s << "r" << x << "(" << vx << ") = r" << y << "(" << vy << ")";
+        break;
+    case Chip8::OpOr:
+        s << "r" << x << "(" << vx << ") |= r" << y << "(" << vy << ")";
+        break;
+    case Chip8::OpAnd:
+        s << "r" << x << "(" << vx << ") &= r" << y << "(" << vy << ")";
+        break;
+    case Chip8::OpXor:
+        s << "r" << x << "(" << vx << ") ^= r" << y << "(" << vy << ")";
+        break;
+    case Chip8::OpAdd:
+        s << "r" << x << "(" << vx << ") += r" << y << "(" << vy << ")" << " carry: rf=" << (unsigned int)r.vf;
+        break;
+    case Chip8::OpSub:
+        s << "r" << x << "(" << vx << ") -= r" << y << "(" << vy << ")" << " borrow: rf=" << (unsigned int)r.vf;
+        break;
+    case Chip8::OpShiftRight:
+        s << "r" << x << "(" << xAfter << ") = r" << y << "(" << yAfter << ") >> 1";
+        break;
+    case Chip8::OpSubReverse:
+        s << "r" << x << " = r" << y << "(" << vy << ") - r" << x << "(" << vx << ")" << " borrow: rf=" << (unsigned int)r.vf;
+        break;
+    case Chip8::OpShiftLeft:
+        s << "r" << x << "(" << xAfter << ") = r" << y << "(" << yAfter << ") << 1";
+        break;
+    case Chip8::OpSkipNeqReg:
+        s << "if r" << x << "(0x" << vx << ") != r" << y << "(0x" << vy << ") then skip";
+        break;
+    case Chip8::OpLoadI:
+        s << "set memptr to 0x" << op.nnn;
+        break;
+    case Chip8::OpJumpOffset:
+        // V0 is whatever got from nnn to the target
+        s << "jump to 0x" << op.nnn << " + " << (unsigned int)((r.next - op.nnn) & 0xfff) << " = 0x" << r.next;
+        break;
+    case Chip8::OpRandom:
+        s << "r" << x << " = random(" << (unsigned int)r.value << ") & mask(" << (unsigned int)op.nn << ")";
+        break;
+    case Chip8::OpDraw:
+        s << "draw 8x" << (unsigned int)op.n << " sprite at r" << x << "(" << xAfter << "),r" << y << "(" << yAfter
+            << ") I=" << r.memptr << " - collision:" << (unsigned int)r.vf;
+        break;
+    case Chip8::OpSkipKey:
+        s << "if key r" << x << "(" << vx << ")  is held then skip";
+        break;
+    case Chip8::OpSkipNotKey:
+        s << "if key r" << x << "(" << vx << ") is not held then skip";
+        break;
+    case Chip8::OpGetDelay:
+        s << "Set r" << x << " to delay(" << (unsigned int)r.value << ")";
+        break;
+    case Chip8::OpWaitKey:
+        s << "wait for keypress/";
+        if (!(r.flags & (FlagStopped | FlagStalled)))
+        {
+            s << "key " << xAfter << " was pressed, store in r" << x;
+        }
+        break;
+    case Chip8::OpSetDelay:
+        s << "Set delay to r" << x << "(" << vx << ")";
+        break;
+    case Chip8::OpSetSound:
+        s << "Set sound to r" << x << "(" << vx << ")";
+        break;
+    case Chip8::OpAddI:
+        s << "Increment I(" << r.memptr << ") by r" << x << "(" << vx << ") = " << r.memptr + vx;
+        break;
+    case Chip8::OpFont:
+        s << "Set memptr to char r" << x << "(" << x << ")";
+        break;
+    case Chip8::OpBcd:
+        s << "Store BCD of r" << x << " starting at " << r.memptr
+            << " (" << vx / 100 << "," << (vx % 100) / 10 << "," << vx % 10 << ")";
+        break;
+    case Chip8::OpStore:
+    case Chip8::OpLoad:
+        s << (op.handler == Chip8::OpStore ? "Store" : "Load") << " r0 to r" << x << " starting at " << r.memptr;
+        break;
+    case Chip8::OpExit:
+        s << "exit";
+        break;
+    case Chip8::OpLowRes:
+        s << "low resolution";
+        break;
+    case Chip8::OpHighRes:
+        s << "high resolution";
+        break;
+    case Chip8::OpScrollDown:
+        s << "scroll down " << (unsigned int)op.n;
+        break;
+    case Chip8::OpScrollRight:
+        s << "scroll right";
+        break;
+    case Chip8::OpScrollLeft:
+        s << "scroll left";
+        break;
+    case Chip8::OpDrawLarge:
+        s << "draw 16x16 sprite at r" << x << "(" << xAfter << "),r" << y << "(" << yAfter
+            << ") I=" << r.memptr << " - collision:" << (unsigned int)r.vf;
+        break;
+    case Chip8::OpBigFont:
+        s << "Set memptr to big char r" << x << "(" << vx << ")";
+        break;
+    case Chip8::OpSaveFlags:
+        s << "Save r0 to r" << x << " in flags";
+        break;
+    case Chip8::OpLoadFlags:
+        s << "Load r0 to r" << x << " from flags";
+        break;
+    case Chip8::OpLongI:
+        s << "set memptr to 0x" << r.memptr;
+        break;
+    case Chip8::OpPlanes:
+        s << "select planes " << (x & 3);
+        break;
+    case Chip8::OpAudio:
+        s << "load audio pattern at " << r.memptr;
+        break;
+    case Chip8::OpPitch:
+        s << "set pitch to r" << x << "(" << vx << ")";
+        break;
+    case Chip8::OpSaveRange:
+    case Chip8::OpLoadRange:
+        s << (op.handler == Chip8::OpSaveRange ? "Store" : "Load") << " r" << x << " to r" << y << " starting at " << r.memptr;
+        break;
+    case Chip8::OpScrollUp:
+        s << "scroll up " << (unsigned int)op.n;
+        break;
+    }
+
+    char prefix[16];
+    std::snprintf(prefix, sizeof(prefix), "%04x:%04x ", r.pc, r.opcode);
+    out << prefix << s.str();
+}
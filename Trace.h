@@ -0,0 +1,158 @@
+#pragma once
+
+#include <atomic>
+#include <cstdint>
+#include <cstddef>
+#include <cstdio>
+#include <iosfwd>
+#include <string>
+#include <thread>
+#include <vector>
+
+#include "Chip8.h"
+
+// One executed instruction. Holds what the DEBUG build prints for it, so the
+// text can be rebuilt offline with Tracer::describe().
+struct TraceRecord
+{
+    uint16_t pc;
+    uint16_t opcode;
+    // I before the instruction, after it for F000 nnnn whose address is not
+    // in the opcode
+    uint16_t memptr;
+    // PC after the instruction, before it moves past a non-jump
+    uint16_t next;
+    // Vx and Vy before, Vx and VF after
+    uint8_t vx;
+    uint8_t vy;
+    uint8_t result;
+    uint8_t vf;
+    // Random byte of Cxnn, delay timer read by Fx07
+    uint8_t value;
+    uint8_t flags;
+    // Low bits of Chip8::cycles, a gap means records were dropped
+    uint16_t cycle;
+};
+static_assert(sizeof(TraceRecord) == 16);
+
+// Instruction tracer for Chip8::trace(). Every instruction becomes a 16 byte
+// TraceRecord in a lock-free single-producer ring, so tracing costs a few
+// stores per instruction and runs at close to full speed.
+//
+// By default the ring keeps the last `capacity` records, overwriting the
+// oldest; save() writes them out after the run. With stream() a background
+// thread drains the ring into a file instead. The interpreter never waits for
+// that thread: when the ring is full the record is dropped and counted.
+//
+// Trace files are an 8 byte header ("C8TR", version, record size) followed by
+// the raw records; chip-trace prints them as the DEBUG build would.
+class Tracer
+{
+public:
+    static constexpr bool enabled = true;
+
+    // TraceRecord::flags
+    enum : uint8_t
+    {
+        // The instruction stopped the machine
+        FlagStopped = 1,
+        // Fx0A found no new key and waited out the rest of the run
+        FlagStalled = 2,
+        // A SUPER-CHIP or XO-CHIP instruction ran as undefined under other
+        // quirks
+        FlagUndefined = 4,
+        // Dxy0 drew a sprite of no rows, as it does without SUPER-CHIP
+        FlagNoRows = 8,
+    };
+
+    // Rounded up to a power of two
+    explicit Tracer(size_t capacity = 1 << 16);
+    ~Tracer();
+    Tracer(const Tracer&) = delete;
+    Tracer& operator=(const Tracer&) = delete;
+
+    // Write records to `filename` from now on. Returns false if it can not be
+    // opened or a stream is already running
+    bool stream(const std::string& filename);
+    // Drain the ring and finish the stream. Returns false if writing failed
+    bool close();
+    // The records still in the ring, oldest first. Only while not streaming
+    // and not running
+    std::vector<TraceRecord> records() const;
+    bool save(const std::string& filename) const;
+
+    uint64_t traced() const { return produced; }
+    uint64_t dropped() const { return lost; }
+
+    // Hooks, see Profile.h
+    void instruction(const Chip8& m, const Chip8::DecodedOp& op)
+    {
+        current.pc = m.addrptr;
+        current.opcode = ((uint16_t)m.memory[m.addrptr] << 8) | m.memory[m.addrptr + 1];
+        current.memptr = m.memptr;
+        current.vx = m.regs[op.x];
+        current.vy = m.regs[op.y];
+        current.value = 0;
+        const uint8_t runs = Chip8::handlerUnder(op.handler, m.quirks());
+        current.flags = runs == op.handler ? 0 : runs == Chip8::OpDraw ? FlagNoRows : FlagUndefined;
+        current.cycle = (uint16_t)m.cycles;
+    }
+    void retire(const Chip8& m)
+    {
+        current.next = m.addrptr;
+        current.result = m.regs[(current.opcode >> 8) & 0xf];
+        current.vf = m.regs[0xf];
+        current.flags |= m.done ? FlagStopped : 0;
+        if (current.opcode == 0xf000 && !(current.flags & FlagUndefined))
+        {
+            current.memptr = m.memptr;
+        }
+        push(current);
+    }
+    void delayRead(uint8_t value) { current.value = value; }
+    void random(uint8_t value) { current.value = value; }
+    void stall(const Chip8&, uint64_t) { current.flags |= FlagStalled; }
+    void drawBegin() {}
+    void drawEnd() {}
+
+    // The line the DEBUG build prints for this instruction, without newline
+    static void describe(const TraceRecord& r, std::ostream& out);
+    // Trace file header
+    static void writeHeader(std::FILE* file);
+    static bool readHeader(std::FILE* file, std::string& error);
+
+private:
+    std::vector<TraceRecord> ring;
+    size_t mask;
+    TraceRecord current {};
+
+    // Producer side, only touched by the interpreter
+    alignas(64) uint64_t produced = 0;
+    uint64_t lost = 0;
+    // Last value of `tail` seen, so the producer rarely reads the atomic
+    uint64_t tailSeen = 0;
+    bool streaming = false;
+    std::atomic<uint64_t> head {0};
+    // Consumer side
+    alignas(64) std::atomic<uint64_t> tail {0};
+    std::atomic<bool> stopping {false};
+    bool writeFailed = false;
+    std::FILE* file = nullptr;
+    std::thread writer;
+
+    void push(const TraceRecord& r)
+    {
+        if (streaming && produced - tailSeen > mask)
+        {
+            tailSeen = tail.load(std::memory_order_acquire);
+            if (produced - tailSeen > mask)
+            {
+                lost++;
+                return;
+            }
+        }
+        ring[produced & mask] = r;
+        head.store(++produced, std::memory_order_release);
+    }
+    void drain();
+};
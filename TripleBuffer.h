@@ -0,0 +1,45 @@
+#pragma once
+
+#include <array>
+#include <atomic>
+#include <cstdint>
+
+// Hands the latest value from one writer thread to one reader thread without
+// locks or waiting. The writer fills back() and publish()es it; the reader
+// calls update() and then reads front(). Each side owns one of three slots,
+// the third is swapped between them, so neither ever sees a half written
+// value. Values the reader did not pick up in time are skipped.
+template<typename T>
+class TripleBuffer
+{
+public:
+    T& back() { return slots[backIndex]; }
+    void publish()
+    {
+        backIndex = middle.exchange(backIndex | Fresh, std::memory_order_acq_rel) & IndexMask;
+    }
+
+    // Returns true if front() changed to a newer value
+    bool update()
+    {
+        if (!(middle.load(std::memory_order_relaxed) & Fresh))
+        {
+            return false;
+        }
+        frontIndex = middle.exchange(frontIndex, std::memory_order_acq_rel) & IndexMask;
+        return true;
+    }
+    const T& front() const { return slots[frontIndex]; }
+
+private:
+    static constexpr uint8_t IndexMask = 3;
+    // Set in `middle` when it holds a value the reader has not taken yet
+    static constexpr uint8_t Fresh = 4;
+
+    std::array<T, 3> slots {};
+    // Writer side
+    alignas(64) uint8_t backIndex = 0;
+    // Reader side
+    alignas(64) uint8_t frontIndex = 1;
+    alignas(64) std::atomic<uint8_t> middle {2};
+};
@@ -0,0 +1,311 @@
+#include <algorithm>
+#include <chrono>
+#include <cstdint>
+#include <cstdio>
+#include <cstdlib>
+#include <fstream>
+#include <iostream>
+#include <memory>
+#include <string>
+#include <vector>
+
+#include "Chip8.h"
+#include "Env.h"
+#include "Rom.h"
+
+// Measures instructions per second of the interpreter and the JIT on
+// synthetic ROMs that each stress one kind of instruction, plus any ROM files
+// given on the command line:
+//   chip-bench [--ips N] [--seconds S] [--envs N] [--out results.jsonl] [game.ch8 ...]
+// Every workload runs in 60 Hz frames of ips/60 instructions for at least S
+// seconds. With --envs it also runs as N environments stepped one frame at a
+// time on all cores (Env.h), timing each step. Results go to stdout as a
+// table and, with --out, as one JSON line per workload and engine for
+// comparing builds.
+
+namespace
+{
+    struct Workload
+    {
+        std::string name;
+        std::vector<uint8_t> rom;
+    };
+
+    // Endless loops, so the instruction mix stays the same however long they run
+    std::vector<Workload> syntheticRoms()
+    {
+        return {
+            // 8xy4/8xy5 with carries and borrows
+            {"alu", {
+                0x60, 0x01,             // 200: v0 = 1
+                0x61, 0x03,             // 202: v1 = 3
+                0x62, 0x07,             // 204: v2 = 7
+                0x80, 0x14,             // 206: v0 += v1
+                0x81, 0x25,             // 208: v1 -= v2
+                0x82, 0x04,             // 20a: v2 += v0
+                0x83, 0x15,             // 20c: v3 -= v1
+                0x84, 0x34,             // 20e: v4 += v3
+                0x80, 0x45,             // 210: v0 -= v4
+                0x85, 0x04,             // 212: v5 += v0
+                0x12, 0x06,             // 214: jump 206
+            }},
+            // Dxyn over the whole screen, wrapping, with collisions
+            {"sprites", {
+                0xa2, 0x10,             // 200: I = 210
+                0x60, 0x00,             // 202: v0 = 0
+                0x61, 0x00,             // 204: v1 = 0
+                0xd0, 0x1f,             // 206: draw 8x15 at v0,v1
+                0x70, 0x05,             // 208: v0 += 5
+                0x71, 0x03,             // 20a: v1 += 3
+                0x12, 0x06,             // 20c: jump 206
+                0x00, 0x00,             // 20e: padding
+                0xff, 0x81, 0xbd, 0xa5, 0xa5, 0xbd, 0x81, 0xff,
+                0x3c, 0x42, 0x99, 0xa5, 0x99, 0x42, 0x3c,
+            }},
+            // Fx55/Fx65 of all sixteen registers
+            {"memory", {
+                0xa3, 0x00,             // 200: I = 300
+                0xff, 0x55,             // 202: store v0-vf
+                0xa3, 0x00,             // 204: I = 300
+                0xff, 0x65,             // 206: load v0-vf
+                0x70, 0x01,             // 208: v0 += 1
+                0x12, 0x00,             // 20a: jump 200
+            }},
+            // 2nnn/00EE three calls deep
+            {"calls", {
+                0x22, 0x06,             // 200: call 206
+                0x70, 0x01,             // 202: v0 += 1
+                0x12, 0x00,             // 204: jump 200
+                0x22, 0x0c,             // 206: call 20c
+                0x71, 0x01,             // 208: v1 += 1
+                0x00, 0xee,             // 20a: return
+                0x22, 0x12,             // 20c: call 212
+                0x00, 0xee,             // 20e: return
+                0x00, 0x00,             // 210: padding
+                0x72, 0x01,             // 212: v2 += 1
+                0x00, 0xee,             // 214: return
+            }},
+            // Fx33 of a changing value
+            {"bcd", {
+                0xa3, 0x00,             // 200: I = 300
+                0xf0, 0x33,             // 202: bcd v0
+                0x70, 0x07,             // 204: v0 += 7
+                0x12, 0x02,             // 206: jump 202
+            }},
+            // Cxnn and skips, branches taken at random
+            {"branches", {
+                0xc0, 0xff,             // 200: v0 = random
+                0x40, 0x80,             // 202: skip if v0 != 80
+                0x71, 0x01,             // 204: v1 += 1
+                0x30, 0x10,             // 206: skip if v0 == 10
+                0x72, 0x01,             // 208: v2 += 1
+                0x50, 0x10,             // 20a: skip if v0 == v1
+                0x73, 0x01,             // 20c: v3 += 1
+                0x12, 0x00,             // 20e: jump 200
+            }},
+        };
+    }
+
+    struct Result
+    {
+        uint64_t instructions = 0;
+        double seconds = 0;
+        // Frame times in microseconds
+        double p50 = 0, p90 = 0, p99 = 0, worst = 0;
+    };
+
+    Result run(const Workload& w, bool jit, uint64_t instructionsPerFrame, double minSeconds)
+    {
+        std::unique_ptr<Chip8> machine(new Chip8);
+        if (jit)
+        {
+            machine->enableJit();
+        }
+        machine->load(w.rom.data(), w.rom.size());
+
+        Result result;
+        std::vector<double> frames;
+        auto start = std::chrono::steady_clock::now();
+        while (result.seconds < minSeconds || frames.size() < 100)
+        {
+            auto before = std::chrono::steady_clock::now();
+            result.instructions += machine->runFrame(instructionsPerFrame);
+            auto after = std::chrono::steady_clock::now();
+            frames.push_back(std::chrono::duration<double, std::micro>(after - before).count());
+            result.seconds = std::chrono::duration<double>(after - start).count();
+            if (machine->done)
+            {
+                // Real ROMs may exit, start them over
+                machine->reset();
+                machine->load(w.rom.data(), w.rom.size());
+            }
+        }
+
+        std::sort(frames.begin(), frames.end());
+        auto percentile = [&](double p)
+        {
+            return frames[std::min(frames.size() - 1, (size_t)(p * frames.size()))];
+        };
+        result.p50 = percentile(0.50);
+        result.p90 = percentile(0.90);
+        result.p99 = percentile(0.99);
+        result.worst = frames.back();
+        return result;
+    }
+
+    // Same as run() through an Env, one frame per step, the times being those
+    // of whole steps
+    Result runEnv(const Workload& w, size_t envs, uint64_t instructionsPerFrame, double minSeconds)
+    {
+        EnvOptions options;
+        options.instructionsPerFrame = instructionsPerFrame;
+        options.frameSkip = 1;
+        Env env(envs, options);
+        std::string error;
+        env.load(w.rom.data(), w.rom.size(), error);
+        std::vector<uint8_t> observations(env.count() * env.observationSize());
+        std::vector<uint16_t> actions(env.count());
+        std::vector<float> rewards(env.count());
+        std::vector<uint8_t> dones(env.count());
+        env.reset(nullptr, observations.data());
+
+        Result result;
+        std::vector<double> frames;
+        std::vector<uint64_t> before(env.count());
+        auto start = std::chrono::steady_clock::now();
+        while (result.seconds < minSeconds || frames.size() < 100)
+        {
+            for (size_t i = 0; i < env.count(); i++)
+            {
+                before[i] = env.machine(i).cycles;
+            }
+            auto t0 = std::chrono::steady_clock::now();
+            env.step(actions.data(), observations.data(), rewards.data(), dones.data());
+            auto t1 = std::chrono::steady_clock::now();
+            frames.push_back(std::chrono::duration<double, std::micro>(t1 - t0).count());
+            result.seconds = std::chrono::duration<double>(t1 - start).count();
+            for (size_t i = 0; i < env.count(); i++)
+            {
+                result.instructions += env.machine(i).cycles - before[i];
+            }
+            // Real ROMs may exit, start them over
+            env.reset(dones.data(), observations.data());
+        }
+
+        std::sort(frames.begin(), frames.end());
+        auto percentile = [&](double p)
+        {
+            return frames[std::min(frames.size() - 1, (size_t)(p * frames.size()))];
+        };
+        result.p50 = percentile(0.50);
+        result.p90 = percentile(0.90);
+        result.p99 = percentile(0.99);
+        result.worst = frames.back();
+        return result;
+    }
+
+    // Workloads run under the modern quirks
+    bool readRom(const std::string& filename, Workload& w, std::string& error)
+    {
+        RomFile rom;
+        if (!rom.open(filename, error))
+        {
+            return false;
+        }
+        if (rom.size() > Chip8::maxRomSize(Chip8::QuirksModern))
+        {
+            error = filename + " does not fit in memory under modern";
+            return false;
+        }
+        w.name = filename;
+        w.rom.assign(rom.data(), rom.data() + rom.size());
+        return true;
+    }
+}
+
+int main(int argc, char* argv[])
+{
+    long ips = 1000000;
+    double minSeconds = 0.5;
+    std::string outFile;
+    size_t envs = 0;
+    std::vector<Workload> workloads = syntheticRoms();
+    for (int a = 1; a < argc; a++)
+    {
+        std::string arg = argv[a];
+        if (arg == "--ips" && a+1 < argc)
+        {
+            ips = std::max(60L, std::strtol(argv[++a], nullptr, 0));
+        }
+        else if (arg == "--seconds" && a+1 < argc)
+        {
+            minSeconds = std::strtod(argv[++a], nullptr);
+        }
+        else if (arg == "--envs" && a+1 < argc)
+        {
+            envs = std::strtoul(argv[++a], nullptr, 0);
+        }
+        else if (arg == "--out" && a+1 < argc)
+        {
+            outFile = argv[++a];
+        }
+        else
+        {
+            Workload w;
+            std::string error;
+            if (!readRom(arg, w, error))
+            {
+                std::cerr << error << std::endl;
+                return 1;
+            }
+            workloads.push_back(w);
+        }
+    }
+    const uint64_t instructionsPerFrame = ips / 60;
+
+    std::ofstream out;
+    if (!outFile.empty())
+    {
+        out.open(outFile);
+        if (!out)
+        {
+            std::cerr << "Could not open " << outFile << std::endl;
+            return 1;
+        }
+    }
+
+    // The JIT row is left out where it is not supported
+    Chip8 probe;
+    const bool haveJit = probe.enableJit();
+
+    std::printf("%-20s %-12s %12s %10s %10s %10s %10s %10s\n", "workload", "engine", "Minstr/s", "ns/instr",
+        "p50 us", "p90 us", "p99 us", "max us");
+    for (const Workload& w : workloads)
+    {
+        for (int engineIndex = 0; engineIndex < 3; engineIndex++)
+        {
+            if ((engineIndex == 1 && !haveJit) || (engineIndex == 2 && !envs))
+            {
+                continue;
+            }
+            const std::string engine = engineIndex == 0 ? "interpreter" : engineIndex == 1 ? "jit" : "env x" + std::to_string(envs);
+            Result r = engineIndex == 2 ? runEnv(w, envs, instructionsPerFrame, minSeconds)
+                : run(w, engineIndex == 1, instructionsPerFrame, minSeconds);
+            double perSecond = r.instructions / r.seconds;
+            double nsPerInstruction = r.seconds * 1e9 / r.instructions;
+            std::printf("%-20s %-12s %12.1f %10.2f %10.1f %10.1f %10.1f %10.1f\n", w.name.c_str(), engine.c_str(),
+                perSecond / 1e6, nsPerInstruction, r.p50, r.p90, r.p99, r.worst);
+            if (out)
+            {
+                out << "{\"workload\":\"" << w.name << "\",\"engine\":\"" << engine
+                    << "\",\"instructions_per_frame\":" << instructionsPerFrame
+                    << ",\"instructions\":" << r.instructions << ",\"seconds\":" << r.seconds
+                    << ",\"ips\":" << (uint64_t)perSecond << ",\"ns_per_instruction\":" << nsPerInstruction
+                    << ",\"frame_us_p50\":" << r.p50 << ",\"frame_us_p90\":" << r.p90
+                    << ",\"frame_us_p99\":" << r.p99 << ",\"frame_us_max\":" << r.worst
+                    << ",\"compiler\":\"" << __VERSION__ << "\"}\n";
+            }
+        }
+    }
+    return 0;
+}
@@ -0,0 +1,70 @@
+#!/bin/sh
+# Runs a few synthetic ROMs with --sweep and again one seed at a time through
+# --batch, with and without the JIT, and fails if any seed ends differently
+# (cycles, exit reason or screen). Used by `make check`:
+#   ./check-sweep.sh [path/to/chip-headless]
+headless=${1:-./chip-headless}
+seeds=20
+cycles=5000
+dir=$(mktemp -d)
+trap 'rm -rf "$dir"' EXIT
+
+# rom <name> <bytes in hex>
+rom()
+{
+    bytes=""
+    for b in $2
+    do
+        bytes="$bytes\\$(printf '%03o' "0x$b")"
+    done
+    printf "$bytes" > "$dir/$1.ch8"
+}
+
+# Dxy0 in a loop, an empty sprite under the modern quirks
+rom dxy0 "A2 00 D0 10 12 02"
+# The other SUPER-CHIP instructions, all undefined under modern
+rom schip "00 FF 00 FD 60 05 F0 30 F0 75 F1 85 00 C2 00 FB 00 FC 00 FE D0 12 12 00"
+# XO-CHIP instructions, undefined as well
+rom xochip "F0 00 03 00 50 12 50 13 F0 02 F1 3A 00 D2 F1 01 12 00"
+# Random sprites at random places, random branches and BCD into the font
+rom random "C0 3F C1 1F C2 0F F2 29 D0 15 C3 01 33 00 12 14 74 01 12 00 22 18 12 00 F4 33 00 EE"
+# Writes a random 6xnn into its own code and runs it
+rom selfmod "A2 0C 60 61 C1 FF F1 55 12 0C 00 00 00 00 F1 29 D0 15 12 00"
+# Polls the delay timer, then waits for a key that never comes
+rom timers "60 10 F0 15 F1 07 31 00 12 04 F2 0A 12 00"
+
+# The fields both print, in seed order
+sweepResults()
+{
+    sed 's/,"seconds".*//' | sort -t: -k2 -n
+}
+batchResults()
+{
+    sed 's/^{"job":[0-9]*,"rom":"[^"]*",/{/; s/,"frames":[0-9]*//; s/,"seconds".*//' | sort -t: -k2 -n
+}
+
+failed=0
+for r in "$dir"/*.ch8
+do
+    : > "$dir/jobs.txt"
+    s=1
+    while [ $s -le $seeds ]
+    do
+        echo "$r $cycles $s" >> "$dir/jobs.txt"
+        s=$((s + 1))
+    done
+    "$headless" --sweep $seeds "$r" $cycles | sweepResults > "$dir/sweep.txt"
+    for jit in "" --jit
+    do
+        "$headless" $jit --batch "$dir/jobs.txt" --out "$dir/batch.jsonl" > /dev/null
+        batchResults < "$dir/batch.jsonl" > "$dir/single.txt"
+        if ! cmp -s "$dir/sweep.txt" "$dir/single.txt" || [ ! -s "$dir/sweep.txt" ]
+        then
+            echo "$(basename "$r" .ch8)$jit: --sweep differs from single runs"
+            diff "$dir/sweep.txt" "$dir/single.txt" | head -4
+            failed=1
+        fi
+    done
+done
+[ $failed = 0 ] && echo "--sweep matches single runs"
+exit $failed
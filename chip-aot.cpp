@@ -0,0 +1,422 @@
+#include <cstdint>
+#include <cstdio>
+#include <fstream>
+#include <iostream>
+#include <memory>
+#include <sstream>
+#include <string>
+#include <vector>
+
+#include "Chip8.h"
+#include "Rom.h"
+
+// Translates a ROM ahead of time into a C++ file with one function per basic
+// block, see Aot.h:
+//   chip-aot [--quirks <profile>] <game.ch8> <game.aot.cpp>
+//   g++ -std=c++20 -O2 -I. game.aot.cpp libchip8.a -o game
+// or `make game-native` for game.ch8. The blocks are found by following
+// jumps, calls and skips from 0x200 (RomImage::build). Bnnn and Fx0A end a
+// block and run in the interpreter, as does anything not reached from 0x200.
+// Fx55 and Fx33 end their block, so code they rewrite is never run from a
+// translation. The quirks are built into the code; XO-CHIP is not supported.
+
+namespace
+{
+    const uint16_t AddressMask = Chip8::ClassicMemorySize - 1;
+
+    enum Kind { Straight, Terminator, Interpreted };
+
+    Kind classify(uint8_t handler)
+    {
+        switch (handler)
+        {
+        case Chip8::OpJump:
+        case Chip8::OpCall:
+        case Chip8::OpReturn:
+        case Chip8::OpSkipEqImm:
+        case Chip8::OpSkipNeqImm:
+        case Chip8::OpSkipEqReg:
+        case Chip8::OpSkipNeqReg:
+        case Chip8::OpSkipKey:
+        case Chip8::OpSkipNotKey:
+        case Chip8::OpExit:
+        // Writes to memory end the block, the rest of it may have changed
+        case Chip8::OpBcd:
+        case Chip8::OpStore:
+            return Terminator;
+        case Chip8::OpJumpOffset:
+        case Chip8::OpWaitKey:
+        case Chip8::OpNotDecoded:
+            return Interpreted;
+        default:
+            return Straight;
+        }
+    }
+
+    struct Block
+    {
+        uint16_t start;
+        std::vector<Chip8::DecodedOp> ops;
+        uint16_t end() const { return start + 2 * ops.size(); }
+    };
+
+    std::string hex(unsigned int v, int digits = 3)
+    {
+        char s[16];
+        std::snprintf(s, sizeof(s), "0x%0*x", digits, v);
+        return s;
+    }
+
+    // Function of the block at pc
+    std::string name(uint16_t pc)
+    {
+        char s[16];
+        std::snprintf(s, sizeof(s), "block%03x", pc);
+        return s;
+    }
+
+    std::string V(uint8_t x)
+    {
+        char s[4];
+        std::snprintf(s, sizeof(s), "v%x", x);
+        return s;
+    }
+
+    // C++ for one instruction at pc. Terminators also set m.addrptr.
+    std::string translate(const Chip8::DecodedOp& op, uint16_t pc, const Quirks& quirks)
+    {
+        const std::string vx = V(op.x), vy = V(op.y), vf = V(0xf);
+        const std::string next = hex(pc + 2), skip = hex(pc + 4);
+        const std::string clip = quirks.clip ? "true" : "false";
+        std::ostringstream s;
+        auto skipIf = [&](const std::string& condition)
+        {
+            s << "m.addrptr = " << condition << " ? " << skip << " : " << next << ";";
+        };
+        auto advance = [&]()
+        {
+            if (quirks.index != Quirks::IndexKept)
+            {
+                s << " i += " << op.x + (quirks.index == Quirks::IndexAfter) << ";";
+            }
+        };
+        switch (op.handler)
+        {
+        case Chip8::OpClear: s << "m.clearPlanes(m.planeMask);"; break;
+        case Chip8::OpReturn:
+            s << "if (m.sp == 0) { m.stop(Chip8::ExitReturnEmptyStack); m.addrptr = " << next
+                << "; } else { m.addrptr = m.stack[--m.sp] + 2; }";
+            break;
+        case Chip8::OpJump: s << "m.addrptr = " << hex(op.nnn) << ";"; break;
+        case Chip8::OpCall:
+            s << "if (m.sp == Chip8::StackDepth) { m.stop(Chip8::ExitStackOverflow); m.addrptr = " << next
+                << "; } else { m.stack[m.sp++] = " << hex(pc) << "; m.addrptr = " << hex(op.nnn) << "; }";
+            break;
+        case Chip8::OpSkipEqImm: skipIf(vx + " == " + hex(op.nn, 2)); break;
+        case Chip8::OpSkipNeqImm: skipIf(vx + " != " + hex(op.nn, 2)); break;
+        case Chip8::OpSkipEqReg: skipIf(vx + " == " + vy); break;
+        case Chip8::OpSkipNeqReg: skipIf(vx + " != " + vy); break;
+        case Chip8::OpSkipKey: skipIf("m.keyDown(" + vx + ")"); break;
+        case Chip8::OpSkipNotKey: skipIf("!m.keyDown(" + vx + ")"); break;
+        case Chip8::OpLoadImm: s << vx << " = " << hex(op.nn, 2) << ";"; break;
+        case Chip8::OpAddImm: s << vx << " += " << hex(op.nn, 2) << ";"; break;
+        case Chip8::OpMove: s << vx << " = " << vy << ";"; break;
+        case Chip8::OpOr:
+        case Chip8::OpAnd:
+        case Chip8::OpXor:
+            s << vx << " " << (op.handler == Chip8::OpOr ? "|" : op.handler == Chip8::OpAnd ? "&" : "^") << "= " << vy << ";";
+            if (quirks.vfReset)
+            {
+                s << " " << vf << " = 0;";
+            }
+            break;
+        // The flag is worked out first and written last, VF may be Vx or Vy
+        case Chip8::OpAdd:
+            s << "{ uint8_t c = (" << vx << " + " << vy << ") > 0xff; " << vx << " += " << vy << "; " << vf << " = c; }";
+            break;
+        case Chip8::OpSub:
+            s << "{ uint8_t c = " << vx << " >= " << vy << "; " << vx << " -= " << vy << "; " << vf << " = c; }";
+            break;
+        case Chip8::OpSubReverse:
+            s << "{ uint8_t c = " << vy << " >= " << vx << "; " << vx << " = " << vy << " - " << vx << "; " << vf << " = c; }";
+            break;
+        case Chip8::OpShiftRight:
+            s << "{ uint8_t s = " << (quirks.shiftVx ? vx : vy) << "; " << vx << " = s >> 1; " << vf << " = s & 1; }";
+            break;
+        case Chip8::OpShiftLeft:
+            s << "{ uint8_t s = " << (quirks.shiftVx ? vx : vy) << "; " << vx << " = s << 1; " << vf << " = s >> 7; }";
+            break;
+        case Chip8::OpLoadI: s << "i = " << hex(op.nnn) << ";"; break;
+        case Chip8::OpRandom: s << vx << " = m.random() & " << hex(op.nn, 2) << ";"; break;
+        case Chip8::OpDraw:
+        case Chip8::OpDrawLarge:
+            if (op.handler == Chip8::OpDraw && op.n == 0)
+            {
+                // Dxy0 without SUPER-CHIP draws no rows
+                s << vf << " = 0;";
+                break;
+            }
+            s << vf << " = m.drawFromMemory<" << clip << ", Chip8::ClassicMemorySize>(" << vx << ", " << vy << ", i, " << (unsigned int)op.n << ");";
+            break;
+        case Chip8::OpGetDelay: s << vx << " = m.delay;"; break;
+        case Chip8::OpSetDelay: s << "m.delay = " << vx << ";"; break;
+        case Chip8::OpSetSound: s << "m.sound = " << vx << ";"; break;
+        case Chip8::OpAddI: s << "i += " << vx << ";"; break;
+        case Chip8::OpFont: s << "i = (" << vx << " & 0xf) * 5;"; break;
+        case Chip8::OpBigFont: s << "i = Chip8::BigFontStart + (" << vx << " & 0xf) * 10;"; break;
+        case Chip8::OpBcd:
+            s << "{ const uint8_t b[3] = {(uint8_t)(" << vx << " / 100), (uint8_t)(" << vx << " / 10 % 10), (uint8_t)(" << vx << " % 10)}; "
+                << "m.writeMemory<Chip8::ClassicMemorySize>(i, b, 3); } m.addrptr = " << next << ";";
+            break;
+        case Chip8::OpStore:
+            s << "{ const uint8_t b[" << op.x + 1 << "] = {";
+            for (uint8_t r = 0; r <= op.x; r++)
+            {
+                s << (r ? ", " : "") << V(r);
+            }
+            s << "}; m.writeMemory<Chip8::ClassicMemorySize>(i, b, " << op.x + 1 << "); }";
+            advance();
+            s << " m.addrptr = " << next << ";";
+            break;
+        case Chip8::OpLoad:
+            for (uint8_t r = 0; r <= op.x; r++)
+            {
+                s << (r ? " " : "") << V(r) << " = m.memory[(i + " << (unsigned int)r << ") & " << hex(AddressMask) << "];";
+            }
+            advance();
+            break;
+        case Chip8::OpExit: s << "m.stop(Chip8::ExitProgram); m.addrptr = " << next << ";"; break;
+        case Chip8::OpLowRes: s << "m.setHires(false);"; break;
+        case Chip8::OpHighRes: s << "m.setHires(true);"; break;
+        case Chip8::OpScrollDown: s << "m.scrollDown(" << (unsigned int)op.n << ");"; break;
+        case Chip8::OpScrollRight: s << "m.scrollRight();"; break;
+        case Chip8::OpScrollLeft: s << "m.scrollLeft();"; break;
+        case Chip8::OpSaveFlags:
+            for (uint8_t r = 0; r <= op.x; r++)
+            {
+                s << (r ? " " : "") << "m.userFlags[" << (unsigned int)r << "] = " << V(r) << ";";
+            }
+            break;
+        case Chip8::OpLoadFlags:
+            for (uint8_t r = 0; r <= op.x; r++)
+            {
+                s << (r ? " " : "") << V(r) << " = m.userFlags[" << (unsigned int)r << "];";
+            }
+            break;
+        default:
+            // Undefined, including what the quirks leave out
+            s << "// undefined";
+            break;
+        }
+        return s.str();
+    }
+
+    // Bit x set if the instruction names Vx. Over-approximates, which only
+    // costs a load and a store.
+    uint16_t registersUsed(const Chip8::DecodedOp& op)
+    {
+        switch (op.handler)
+        {
+        case Chip8::OpStore:
+        case Chip8::OpLoad:
+        case Chip8::OpSaveFlags:
+        case Chip8::OpLoadFlags:
+            return (2 << op.x) - 1;
+        case Chip8::OpAdd:
+        case Chip8::OpSub:
+        case Chip8::OpSubReverse:
+        case Chip8::OpShiftRight:
+        case Chip8::OpShiftLeft:
+        case Chip8::OpDraw:
+        case Chip8::OpDrawLarge:
+        case Chip8::OpOr:
+        case Chip8::OpAnd:
+        case Chip8::OpXor:
+            return 1 << op.x | 1 << op.y | 1 << 0xf;
+        default:
+            return 1 << op.x | 1 << op.y;
+        }
+    }
+
+    void emitBlock(std::ostream& out, const Block& block, const Quirks& quirks)
+    {
+        uint16_t used = 0;
+        for (const Chip8::DecodedOp& op : block.ops)
+        {
+            used |= registersUsed(op);
+        }
+        out << "    // " << hex(block.start) << "-" << hex(block.end() - 1) << "\n";
+        out << "    void " << name(block.start) << "(Chip8& m, uint32_t from, uint32_t to)\n    {\n";
+        for (uint8_t x = 0; x < 16; x++)
+        {
+            if (used & (1 << x))
+            {
+                out << "        uint8_t " << V(x) << " = m.regs[" << hex(x, 1) << "];\n";
+            }
+        }
+        out << "        uint16_t i = m.memptr;\n";
+        out << "        switch (from)\n        {\n";
+        for (size_t k = 0; k < block.ops.size(); k++)
+        {
+            const Chip8::DecodedOp& op = block.ops[k];
+            const uint16_t pc = block.start + 2 * k;
+            out << "        case " << k << ":\n";
+            out << "            " << translate(op, pc, quirks) << "\n";
+            if (classify(op.handler) == Terminator)
+            {
+                break;
+            }
+            if (k + 1 < block.ops.size())
+            {
+                out << "            if (to == " << k + 1 << ") { m.addrptr = " << hex(pc + 2) << "; break; }\n";
+                out << "            [[fallthrough]];\n";
+            }
+            else
+            {
+                out << "            m.addrptr = " << hex(pc + 2) << ";\n";
+            }
+        }
+        out << "        }\n";
+        for (uint8_t x = 0; x < 16; x++)
+        {
+            if (used & (1 << x))
+            {
+                out << "        m.regs[" << hex(x, 1) << "] = " << V(x) << ";\n";
+            }
+        }
+        out << "        m.memptr = i;\n";
+        out << "        m.cycles += to - from;\n";
+        out << "    }\n\n";
+    }
+}
+
+int main(int argc, char* argv[])
+{
+    std::string input, output;
+    Chip8::QuirkProfile profile = Chip8::QuirksModern;
+    for (int a = 1; a < argc; a++)
+    {
+        std::string arg = argv[a];
+        if (arg == "--quirks" && a+1 < argc)
+        {
+            if (!Chip8::parseQuirks(argv[++a], profile) || Chip8::quirkTable[profile].xoChip)
+            {
+                std::cerr << "Unsupported quirk profile " << argv[a] << ", expected modern, vip, chip48 or schip" << std::endl;
+                return 2;
+            }
+        }
+        else if (input.empty())
+        {
+            input = arg;
+        }
+        else if (output.empty())
+        {
+            output = arg;
+        }
+        else
+        {
+            input.clear();
+            break;
+        }
+    }
+    if (input.empty() || output.empty())
+    {
+        std::cerr << "usage: " << argv[0] << " [--quirks <profile>] <game.ch8> <game.aot.cpp>" << std::endl;
+        return 2;
+    }
+    const Quirks& quirks = Chip8::quirkTable[profile];
+
+    RomFile rom;
+    std::string error;
+    if (!rom.open(input, error))
+    {
+        std::cerr << error << std::endl;
+        return 1;
+    }
+    if (rom.size() > Chip8::ClassicMemorySize - Chip8::ProgramStart)
+    {
+        std::cerr << input << " does not fit in 4 KB, XO-CHIP programs are not supported" << std::endl;
+        return 1;
+    }
+    std::unique_ptr<RomImage> image(new RomImage);
+    image->build(rom.data(), rom.size());
+    // Everything below sees what the instructions run as under the quirks
+    for (Chip8::DecodedOp& op : image->decoded)
+    {
+        op.handler = Chip8::handlerUnder(op.handler, quirks);
+    }
+
+    // A block starts wherever something branches to, after an instruction
+    // that ends a block, and where reachable code follows something else
+    auto isCode = [&](int pc)
+    {
+        return pc >= 0 && pc < (int)Chip8::ClassicMemorySize - 1 && (image->flags[pc] & RomImage::Code);
+    };
+    auto compiled = [&](int pc)
+    {
+        return isCode(pc) && classify(image->decoded[pc].handler) != Interpreted;
+    };
+    auto leader = [&](int pc)
+    {
+        return (image->flags[pc] & RomImage::Target) || !compiled(pc - 2)
+            || classify(image->decoded[pc - 2].handler) == Terminator;
+    };
+    std::vector<Block> blocks;
+    for (int pc = 0; pc < (int)Chip8::ClassicMemorySize - 1; pc++)
+    {
+        if (!compiled(pc) || !leader(pc))
+        {
+            continue;
+        }
+        Block block;
+        block.start = pc;
+        int at = pc;
+        do
+        {
+            block.ops.push_back(image->decoded[at]);
+            at += 2;
+        }
+        while (classify(block.ops.back().handler) != Terminator && compiled(at) && !leader(at));
+        blocks.push_back(block);
+    }
+
+    std::ofstream out(output);
+    if (!out)
+    {
+        std::cerr << "Could not open " << output << std::endl;
+        return 1;
+    }
+    out << "// Translated from " << input << " by chip-aot with the " << Chip8::quirkName(profile)
+        << " quirks, see Aot.h.\n";
+    out << "#include \"Aot.h\"\n\nnamespace\n{\n";
+    out << "    const uint8_t rom[] = {";
+    for (size_t i = 0; i < rom.size(); i++)
+    {
+        out << (i % 16 ? " " : "\n        ") << hex(rom.data()[i], 2) << ",";
+    }
+    out << "\n    };\n\n";
+    for (const Block& block : blocks)
+    {
+        emitBlock(out, block, quirks);
+    }
+    out << "    const AotBlock blocks[] = {\n";
+    for (const Block& block : blocks)
+    {
+        out << "        {" << hex(block.start) << ", " << hex(block.end()) << ", " << block.ops.size()
+            << ", " << name(block.start) << "},\n";
+    }
+    // The table is never empty, even if the ROM starts with a Bnnn
+    out << "        {0, 0, 0, nullptr},\n";
+    out << "    };\n}\n\n";
+    out << "const AotProgram program = {rom, sizeof(rom), (Chip8::QuirkProfile)" << (unsigned int)profile
+        << ", blocks, sizeof(blocks) / sizeof(blocks[0]) - 1};\n\n";
+    out << "int main(int argc, char* argv[])\n{\n    return aotMain(argc, argv, program);\n}\n";
+    out.close();
+    if (!out)
+    {
+        std::cerr << "Could not write " << output << std::endl;
+        return 1;
+    }
+    std::cerr << blocks.size() << " blocks" << std::endl;
+    return 0;
+}
@@ -0,0 +1,58 @@
+#include <cstdint>
+#include <cstdio>
+#include <iostream>
+#include <string>
+
+#include "Trace.h"
+
+// Prints a trace written by `chip-headless --trace` as the text the DEBUG
+// build prints while running:
+//   chip-trace <trace.c8t>
+// Records that were dropped because the writer fell behind show up as a gap
+// in the cycle numbers and are marked in the output.
+
+int main(int argc, char* argv[])
+{
+    if (argc != 2)
+    {
+        std::cerr << "usage: " << argv[0] << " <trace.c8t>" << std::endl;
+        return 2;
+    }
+    std::FILE* in = std::fopen(argv[1], "rb");
+    if (!in)
+    {
+        std::cerr << "Could not open " << argv[1] << std::endl;
+        return 1;
+    }
+    std::string error;
+    if (!Tracer::readHeader(in, error))
+    {
+        std::cerr << argv[1] << ": " << error << std::endl;
+        std::fclose(in);
+        return 1;
+    }
+
+    TraceRecord records[4096];
+    // No gap to report before the first record, nor after a stalled Fx0A,
+    // which waits out the rest of its run
+    bool gapOk = true;
+    uint16_t expected = 0;
+    size_t count;
+    while ((count = std::fread(records, sizeof(TraceRecord), sizeof(records) / sizeof(records[0]), in)) > 0)
+    {
+        for (size_t i = 0; i < count; i++)
+        {
+            const TraceRecord& r = records[i];
+            if (!gapOk && r.cycle != expected)
+            {
+                std::cout << "-- " << std::dec << (uint16_t)(r.cycle - expected) << " instructions not traced --\n";
+            }
+            gapOk = r.flags & Tracer::FlagStalled;
+            expected = r.cycle + 1;
+            Tracer::describe(r, std::cout);
+            std::cout << '\n';
+        }
+    }
+    std::fclose(in);
+    return 0;
+}
@@ -0,0 +1,451 @@
+#include <algorithm>
+#include <chrono>
+#include <csignal>
+#include <cstdint>
+#include <cstdio>
+#include <cstdlib>
+#include <fstream>
+#include <iostream>
+#include <memory>
+#include <string>
+
+#include "Audio.h"
+#include "Chip8.h"
+#include "Batch.h"
+#include "FrameStream.h"
+#include "Lockstep.h"
+#include "Profile.h"
+#include "Recording.h"
+#include "Rom.h"
+#include "Trace.h"
+
+// Runs a ROM without a window at full host speed:
+//   chip-headless [--ips N] [--quirks <profile>] [--jit] [--profile <profile.json>] [--trace <trace.c8t>] [--wav <sound.wav>] [--cache <dir>] [<frame options>] <game.ch8> [cycles]
+// or a list of jobs on all cores, see Batch.h:
+//   chip-headless [--ips N] [--quirks <profile>] [--jit] [--threads N] [--cache <dir>] --batch <jobs.txt> [--out <results.jsonl>]
+// or one ROM with seeds 1 to N side by side on SIMD lanes, see Lockstep.h:
+//   chip-headless [--ips N] --sweep N <game.ch8> [cycles]
+// or a session recorded with `chip --record`, see Recording.h:
+//   chip-headless [--jit] [--profile <profile.json>] [--trace <trace.c8t>] [--wav <sound.wav>] [<frame options>] --replay <session.c8r> <game.ch8>
+// Frame options publish every frame, see FrameStream.h:
+//   --frame-ring <name> [--frame-slots N] into a shared memory ring
+//   --frames <file|-> [--frame-format raw|pbm] to a file or pipe
+// With --frames - the summary goes to stderr.
+// --trace streams every instruction to a file for chip-trace, see Trace.h.
+// --wav writes the buzzer to a .wav file at 60 ticks per emulated second.
+// --cache <dir> loads ROMs through a cache of analysed images, see Rom.h.
+// --quirks picks the behaviour of the ambiguous instructions: modern (the
+// default), vip, chip48, schip or xochip, see Quirks in Chip8.h. A replay
+// uses the profile it was recorded with, a sweep only runs modern.
+// Timers are ticked every ips/60 instructions so games that wait on the
+// delay timer see the same timing as in the window.
+
+int usage(const char* name)
+{
+    std::cerr << "usage: " << name << " [--ips N] [--quirks <profile>] [--jit] [--profile <profile.json>] [--trace <trace.c8t>] [--wav <sound.wav>] [--cache <dir>] [<frame options>] <game.ch8> [cycles]" << std::endl;
+    std::cerr << "       " << name << " [--ips N] [--quirks <profile>] [--jit] [--threads N] [--cache <dir>] --batch <jobs.txt> [--out <results.jsonl>]" << std::endl;
+    std::cerr << "       " << name << " [--ips N] --sweep N <game.ch8> [cycles]" << std::endl;
+    std::cerr << "       " << name << " [--jit] [--profile <profile.json>] [--trace <trace.c8t>] [--wav <sound.wav>] [<frame options>] --replay <session.c8r> <game.ch8>" << std::endl;
+    std::cerr << "frame options: --frame-ring <name> [--frame-slots N], --frames <file|-> [--frame-format raw|pbm]" << std::endl;
+    return 2;
+}
+
+// Fill every vector register when built with -mavx2
+#ifdef __AVX2__
+constexpr int SweepLanes = 32;
+#else
+constexpr int SweepLanes = 16;
+#endif
+
+// Run seeds 1 to count in lockstep and print one JSON line per seed, in the
+// same format as the batch runner
+int sweep(const std::string& filename, uint32_t count, uint64_t cycles, uint64_t instructionsPerTick)
+{
+    std::unique_ptr<Lockstep<SweepLanes>> engine(new Lockstep<SweepLanes>);
+    std::unique_ptr<Chip8> lane(new Chip8);
+    for (uint32_t first = 1; first <= count; first += SweepLanes)
+    {
+        engine->reset();
+        if (!engine->loadFile(filename))
+        {
+            std::cerr << "Could not load " << filename << std::endl;
+            return 1;
+        }
+        for (int l = 0; l < SweepLanes; l++)
+        {
+            engine->seed(l, first + l);
+            // Park the lanes past the last seed
+            engine->done[l] = first + l > count;
+        }
+
+        auto start = std::chrono::steady_clock::now();
+        uint64_t executed = 0;
+        while (engine->running() && executed < cycles)
+        {
+            uint64_t n = std::min(cycles - executed, instructionsPerTick);
+            engine->runFrame(n);
+            executed += n;
+        }
+        std::chrono::duration<double> elapsed = std::chrono::steady_clock::now() - start;
+
+        for (int l = 0; l < SweepLanes && first + l <= count; l++)
+        {
+            engine->extract(l, *lane);
+            char hash[17];
+            std::snprintf(hash, sizeof(hash), "%016llx", (unsigned long long)lane->screenHash());
+            std::cout << "{\"seed\":" << first + l << ",\"cycles\":" << lane->cycles
+                << ",\"exit\":\"" << (lane->done ? Chip8::exitName((Chip8::ExitReason)lane->exitReason) : "cycle-limit")
+                << "\",\"screen\":\"" << hash << "\",\"seconds\":" << elapsed.count() << "}" << std::endl;
+        }
+    }
+    return 0;
+}
+
+int main(int argc, char* argv[])
+{
+    std::string filename;
+    uint64_t cycles = 1000000;
+    long ips = 700;
+    bool useJit = false;
+    std::string batchFile, outFile;
+    unsigned threads = 0;
+    uint32_t seeds = 0;
+    std::string replayFile;
+    std::string profileFile;
+    std::string traceFile;
+    std::string wavFile;
+    std::string cacheDir;
+    std::string ringName, framesFile;
+    uint32_t ringSlots = 64;
+    FramePipe::Format frameFormat = FramePipe::Raw;
+    Chip8::QuirkProfile quirks = Chip8::QuirksModern;
+    for (int a = 1; a < argc; a++)
+    {
+        std::string arg = argv[a];
+        if (arg == "--ips" && a+1 < argc)
+        {
+            ips = std::max(60L, std::strtol(argv[++a], nullptr, 0));
+        }
+        else if (arg == "--quirks" && a+1 < argc)
+        {
+            if (!Chip8::parseQuirks(argv[++a], quirks))
+            {
+                std::cerr << "Unknown quirk profile " << argv[a] << ", expected modern, vip, chip48, schip or xochip" << std::endl;
+                return 2;
+            }
+        }
+        else if (arg == "--jit")
+        {
+            useJit = true;
+        }
+        else if (arg == "--batch" && a+1 < argc)
+        {
+            batchFile = argv[++a];
+        }
+        else if (arg == "--out" && a+1 < argc)
+        {
+            outFile = argv[++a];
+        }
+        else if (arg == "--threads" && a+1 < argc)
+        {
+            threads = std::strtoul(argv[++a], nullptr, 0);
+        }
+        else if (arg == "--profile" && a+1 < argc)
+        {
+            profileFile = argv[++a];
+        }
+        else if (arg == "--trace" && a+1 < argc)
+        {
+            traceFile = argv[++a];
+        }
+        else if (arg == "--cache" && a+1 < argc)
+        {
+            cacheDir = argv[++a];
+        }
+        else if (arg == "--wav" && a+1 < argc)
+        {
+            wavFile = argv[++a];
+        }
+        else if (arg == "--frame-ring" && a+1 < argc)
+        {
+            ringName = argv[++a];
+        }
+        else if (arg == "--frame-slots" && a+1 < argc)
+        {
+            ringSlots = std::max(1UL, std::strtoul(argv[++a], nullptr, 0));
+        }
+        else if (arg == "--frames" && a+1 < argc)
+        {
+            framesFile = argv[++a];
+        }
+        else if (arg == "--frame-format" && a+1 < argc)
+        {
+            std::string format = argv[++a];
+            if (format != "raw" && format != "pbm")
+            {
+                std::cerr << "Unknown frame format " << format << ", expected raw or pbm" << std::endl;
+                return 2;
+            }
+            frameFormat = format == "pbm" ? FramePipe::Pbm : FramePipe::Raw;
+        }
+        else if (arg == "--replay" && a+1 < argc)
+        {
+            replayFile = argv[++a];
+        }
+        else if (arg == "--sweep" && a+1 < argc)
+        {
+            seeds = std::strtoul(argv[++a], nullptr, 0);
+        }
+        else if (filename.empty())
+        {
+            filename = arg;
+        }
+        else
+        {
+            cycles = std::strtoull(arg.c_str(), nullptr, 0);
+        }
+    }
+    const uint64_t instructionsPerTick = ips / 60;
+
+    if (!batchFile.empty())
+    {
+        std::vector<BatchJob> jobs;
+        std::string error;
+        if (!readBatchJobs(batchFile, jobs, error))
+        {
+            std::cerr << error << std::endl;
+            return 1;
+        }
+        BatchOptions options;
+        options.threads = threads;
+        options.instructionsPerFrame = instructionsPerTick;
+        options.jit = useJit;
+        options.cacheDir = cacheDir;
+        options.quirks = quirks;
+        std::ofstream file;
+        if (!outFile.empty())
+        {
+            file.open(outFile);
+            if (!file)
+            {
+                std::cerr << "Could not open " << outFile << std::endl;
+                return 1;
+            }
+        }
+        size_t failed = runBatch(jobs, options, outFile.empty() ? std::cout : file);
+        return failed ? 1 : 0;
+    }
+    if (filename.empty())
+    {
+        return usage(argv[0]);
+    }
+
+    if (seeds)
+    {
+        // The lockstep engine only implements the modern quirks
+        if (quirks != Chip8::QuirksModern)
+        {
+            std::cerr << "--sweep only supports --quirks modern" << std::endl;
+            return 2;
+        }
+        return sweep(filename, seeds, cycles, instructionsPerTick);
+    }
+
+    static Chip8 machine;
+    machine.setQuirks(quirks);
+    // Before loading, the quirks decide how large a ROM fits
+    Recording session;
+    if (!replayFile.empty())
+    {
+        std::string error;
+        if (!session.load(replayFile, error))
+        {
+            std::cerr << error << std::endl;
+            return 1;
+        }
+        machine.setQuirks(session.quirks);
+    }
+    std::unique_ptr<Profile> profile;
+    if (!profileFile.empty())
+    {
+        // Counting happens in the interpreter
+        profile.reset(new Profile);
+        useJit = false;
+    }
+    std::unique_ptr<Tracer> tracer;
+    if (!traceFile.empty())
+    {
+        // Tracing happens in the interpreter, and takes over from profiling
+        tracer.reset(new Tracer(1 << 20));
+        if (!tracer->stream(traceFile))
+        {
+            std::cerr << "Could not open " << traceFile << std::endl;
+            return 1;
+        }
+        profile.reset();
+        profileFile.clear();
+        useJit = false;
+    }
+    if (useJit && !machine.enableJit())
+    {
+        std::cerr << "JIT not available on this host, interpreting" << std::endl;
+    }
+    if (!cacheDir.empty())
+    {
+        RomCache cache(cacheDir);
+        std::string error;
+        if (!cache.load(filename, machine, error))
+        {
+            std::cerr << error << std::endl;
+            return 1;
+        }
+    }
+    else if (!machine.loadFile(filename))
+    {
+        std::cerr << "Could not load " << filename << std::endl;
+        return 1;
+    }
+
+    std::unique_ptr<Audio> audio;
+    WavSink* wav = nullptr;
+    if (!wavFile.empty())
+    {
+        std::unique_ptr<WavSink> sink(new WavSink);
+        if (!sink->open(wavFile, 44100))
+        {
+            std::cerr << "Could not open " << wavFile << std::endl;
+            return 1;
+        }
+        wav = sink.get();
+        audio.reset(new Audio(std::move(sink)));
+        machine.tickHook = Audio::onTick;
+        machine.tickCtx = audio.get();
+    }
+
+    std::unique_ptr<FrameRing> ring;
+    if (!ringName.empty())
+    {
+        ring.reset(new FrameRing);
+        std::string error;
+        if (!ring->create(ringName, ringSlots, error))
+        {
+            std::cerr << error << std::endl;
+            return 1;
+        }
+    }
+    std::unique_ptr<FramePipe> pipe;
+    if (!framesFile.empty())
+    {
+        // A reader that goes away fails the write instead of killing us
+        std::signal(SIGPIPE, SIG_IGN);
+        pipe.reset(new FramePipe);
+        if (!pipe->open(framesFile, frameFormat))
+        {
+            std::cerr << "Could not open " << framesFile << std::endl;
+            return 1;
+        }
+    }
+    bool framesFailed = false;
+    // Keep stdout for the frames
+    std::ostream& summary = framesFile == "-" ? std::cerr : std::cout;
+
+    if (!replayFile.empty())
+    {
+        if (session.romHash != Recording::programHash(machine))
+        {
+            std::cerr << replayFile << " was recorded with a different ROM" << std::endl;
+            return 1;
+        }
+        machine.seed(session.seed);
+    }
+
+    auto runFrame = [&](uint64_t n)
+    {
+        if (tracer)
+        {
+            machine.trace(n, *tracer);
+            machine.tick();
+        }
+        else if (profile)
+        {
+            machine.profile(n, *profile);
+            machine.tick();
+        }
+        else
+        {
+            machine.runFrame(n);
+        }
+        if (ring)
+        {
+            ring->publish(machine);
+        }
+        if (pipe && !pipe->publish(machine))
+        {
+            framesFailed = true;
+        }
+    };
+
+    auto start = std::chrono::steady_clock::now();
+    if (!replayFile.empty())
+    {
+        // Same frames as the recording, each with the keys held back then
+        for (size_t frame = 0; frame < session.keys.size() && !machine.done && !framesFailed; frame++)
+        {
+            machine.keys = session.keys[frame];
+            runFrame(session.instructionsPerFrame);
+        }
+    }
+    else
+    {
+        while (!machine.done && machine.cycles < cycles && !framesFailed)
+        {
+            runFrame(std::min(cycles - machine.cycles, instructionsPerTick));
+        }
+    }
+    std::chrono::duration<double> elapsed = std::chrono::steady_clock::now() - start;
+
+    summary << "cycles: " << machine.cycles << std::endl;
+    summary << "seconds: " << elapsed.count() << std::endl;
+    summary << "ips: " << (uint64_t)(machine.cycles / elapsed.count()) << std::endl;
+    summary << "screen: " << std::hex << machine.screenHash() << std::dec << std::endl;
+    summary << "exit: " << Chip8::exitName((Chip8::ExitReason)machine.exitReason) << std::endl;
+    if (ring)
+    {
+        summary << "frames: " << ring->published() << std::endl;
+    }
+
+    if (pipe && (!pipe->close() || framesFailed))
+    {
+        std::cerr << "Could not write frames to " << framesFile << std::endl;
+        return 1;
+    }
+
+    if (wav && !wav->close())
+    {
+        std::cerr << "Could not write " << wavFile << std::endl;
+        return 1;
+    }
+    if (tracer)
+    {
+        bool written = tracer->close();
+        summary << "traced: " << tracer->traced() << std::endl;
+        summary << "dropped: " << tracer->dropped() << std::endl;
+        if (!written)
+        {
+            std::cerr << "Could not write " << traceFile << std::endl;
+            return 1;
+        }
+    }
+    if (profile)
+    {
+        profile->report(summary, machine);
+        std::ofstream json(profileFile);
+        profile->writeJson(json);
+        if (!json)
+        {
+            std::cerr << "Could not write " << profileFile << std::endl;
+            return 1;
+        }
+    }
+    return 0;
+}